@@ -0,0 +1,861 @@
+/**
+ * @file    bench.c
+ * @author  Anton Tchekov
+ * @version 0.1
+ * @date    2023-09-02
+ * @brief   Symbol table benchmarks
+ */
+
+#include "bench.h"
+#include "symtab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif /* __linux__ */
+
+#define BENCH_KEYS 200000
+
+typedef struct
+{
+	const char *Name;
+	void (*Run)(void);
+} Benchmark;
+
+/* --- PRIVATE --- */
+static double _now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Identifiers with shared prefixes, similar to a program's symbols */
+static char **_keys_create(int count)
+{
+	static const char *prefixes[] =
+	{
+		"symtab_", "test_", "get_", "set_", "net_", "str", "mem", "_"
+	};
+
+	int i;
+	char **keys = malloc(count * sizeof(*keys));
+	srand(1234);
+	for(i = 0; i < count; ++i)
+	{
+		char buf[64];
+		int j, len = 3 + rand() % 12;
+		int n = sprintf(buf, "%s", prefixes[rand() % 8]);
+		for(j = 0; j < len; ++j)
+		{
+			buf[n++] = "abcdefghijklmnopqrstuvwxyz_0123456789"[rand() % 37];
+		}
+
+		buf[n] = '\0';
+		keys[i] = strdup(buf);
+	}
+
+	return keys;
+}
+
+static void _keys_destroy(char **keys, int count)
+{
+	int i;
+	for(i = 0; i < count; ++i)
+	{
+		free(keys[i]);
+	}
+
+	free(keys);
+}
+
+#if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
+
+static double _put_all(SymTab *tab, char **keys, int count)
+{
+	int i;
+	double start = _now();
+	for(i = 0; i < count; ++i)
+	{
+		symtab_put(tab, keys[i], i + 1);
+	}
+
+	return _now() - start;
+}
+
+static double _put_durable(char **keys, int count, int sync_every)
+{
+	char path[64], name[80];
+	double start;
+	SymTab *tab = symtab_create(count);
+
+	sprintf(path, "/tmp/symtab-bench-%d", (int)getpid());
+	symtab_durable(tab, path, sync_every);
+	start = _now();
+	_put_all(tab, keys, count);
+	symtab_sync(tab);
+	start = _now() - start;
+	symtab_destroy(tab);
+
+	sprintf(name, "%s.log", path);
+	unlink(name);
+	return start;
+}
+
+static void _bench_wal(void)
+{
+	int count = BENCH_KEYS;
+	char **keys = _keys_create(count);
+	SymTab *tab = symtab_create(count);
+	double mem, lazy, group, each;
+
+	mem = _put_all(tab, keys, count);
+	symtab_destroy(tab);
+	lazy = _put_durable(keys, count, 0);
+	group = _put_durable(keys, count, 1024);
+	each = _put_durable(keys, 1000, 1);
+
+	printf("%-28s %10.0f puts/s\n", "in-memory", count / mem);
+	printf("%-28s %10.0f puts/s (%.2fx slower)\n",
+		"wal, sync on symtab_sync", count / lazy, lazy / mem);
+	printf("%-28s %10.0f puts/s (%.2fx slower)\n",
+		"wal, group commit of 1024", count / group, group / mem);
+	printf("%-28s %10.0f puts/s\n", "wal, sync every put", 1000 / each);
+
+	_keys_destroy(keys, count);
+}
+
+#endif
+
+#if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
+
+/* 70% of the lookups are for symbols that don't exist */
+static double _get_mix(SymTab *tab, char **keys, char **misses, int count)
+{
+	int i;
+	long found = 0;
+	double start = _now();
+	for(i = 0; i < 5 * count; ++i)
+	{
+		found += symtab_get(tab,
+			(i % 10 < 7 ? misses : keys)[(i * 7919L) % count]) != 0;
+	}
+
+	return _now() - start + (found < 0);
+}
+
+static void _bench_bloom(void)
+{
+	int i, count = BENCH_KEYS;
+	char **keys = _keys_create(2 * count);
+	char **misses = keys + count;
+	SymTab *tab = symtab_create(count);
+	double plain, filtered;
+
+	for(i = 0; i < count; ++i)
+	{
+		symtab_put(tab, keys[i], i + 1);
+	}
+
+	plain = _get_mix(tab, keys, misses, count);
+	symtab_bloom(tab);
+	filtered = _get_mix(tab, keys, misses, count);
+
+	printf("%-28s %10.0f gets/s\n", "tree", 5 * count / plain);
+	printf("%-28s %10.0f gets/s\n", "bloom filter + tree",
+		5 * count / filtered);
+
+	symtab_destroy(tab);
+	_keys_destroy(keys, 2 * count);
+}
+
+#endif
+
+#if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
+
+static void _iter_count(void *data, int worker, const char *ident, int value)
+{
+	__atomic_add_fetch((long *)data, 1, __ATOMIC_RELAXED);
+	(void)worker;
+	(void)ident;
+	(void)value;
+}
+
+static void _bench_parallel(void)
+{
+	int i, threads, count = 5 * BENCH_KEYS;
+	int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	char **keys = _keys_create(count);
+	int *values = malloc(count * sizeof(*values));
+	double base[4], t[4], start;
+	SymStats stats;
+	SymTab *tab;
+	long found;
+
+	for(i = 0; i < count; ++i)
+	{
+		values[i] = i + 1;
+	}
+
+	printf("%d CPUs, %d symbols\n", cpus, count);
+	printf("%-8s %13s %13s %13s %13s\n",
+		"threads", "build", "stats", "iterate", "destroy");
+
+	for(threads = 1; ; threads *= 2)
+	{
+		if(threads > cpus && threads / 2 < cpus)
+		{
+			threads = cpus;
+		}
+
+		start = _now();
+		tab = symtab_build((const char *const *)keys, values, count, threads);
+		t[0] = _now() - start;
+
+		start = _now();
+		symtab_stats_parallel(tab, &stats, threads);
+		t[1] = _now() - start;
+
+		found = 0;
+		start = _now();
+		symtab_prefix_iter_parallel(tab, "", threads, &found, _iter_count);
+		t[2] = _now() - start;
+
+		start = _now();
+		symtab_destroy_parallel(tab, threads);
+		t[3] = _now() - start;
+
+		if(threads == 1)
+		{
+			memcpy(base, t, sizeof(base));
+		}
+
+		printf("%-8d", threads);
+		for(i = 0; i < 4; ++i)
+		{
+			printf(" %7.3fs %3.1fx", t[i], base[i] / t[i]);
+		}
+
+		printf("\n");
+		if(threads >= cpus)
+		{
+			break;
+		}
+	}
+
+	free(values);
+	_keys_destroy(keys, count);
+}
+
+#endif
+
+#if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
+
+/* URLs and paths, the keys where labels dominate memory */
+static char **_paths_create(int count)
+{
+	static const char *hosts[] =
+	{
+		"https://www.example.com", "https://api.example.org",
+		"http://static.example.net", "file:///usr/share/doc"
+	};
+
+	static const char *dirs[] =
+	{
+		"users", "orders", "products", "images", "download", "account",
+		"settings", "reports", "archive", "library"
+	};
+
+	int i;
+	char **keys = malloc(count * sizeof(*keys));
+	srand(1234);
+	for(i = 0; i < count; ++i)
+	{
+		char buf[160];
+		sprintf(buf, "%s/%s/%d/%s/%s-%d.html", hosts[rand() % 4],
+			dirs[rand() % 10], rand() % 100000, dirs[rand() % 10],
+			dirs[rand() % 10], rand() % 1000);
+
+		keys[i] = strdup(buf);
+	}
+
+	return keys;
+}
+
+static void _bench_compress(void)
+{
+	int i, mode, count = BENCH_KEYS;
+	char **keys = _paths_create(count);
+	double put, get;
+	SymStats stats;
+	long found;
+
+	printf("%-12s %12s %12s %12s %12s\n",
+		"labels", "label bytes", "node bytes", "puts/s", "gets/s");
+
+	for(mode = 0; mode < 2; ++mode)
+	{
+		SymTab *tab = symtab_create(count);
+		if(mode)
+		{
+			symtab_compress(tab, (const char *const *)keys, count);
+		}
+
+		put = _put_all(tab, keys, count);
+		found = 0;
+		get = _now();
+		for(i = 0; i < count; ++i)
+		{
+			found += symtab_get(tab, keys[(i * 7919L) % count]) != 0;
+		}
+
+		get = _now() - get;
+		symtab_stats(tab, &stats);
+		printf("%-12s %12zu %12zu %12.0f %12.0f\n",
+			mode ? "compressed" : "plain", stats.LabelBytes,
+			stats.NodeBytes + stats.AllocatorBytes, count / put,
+			found / get);
+
+		symtab_destroy(tab);
+	}
+
+	_keys_destroy(keys, count);
+}
+
+#endif
+
+#if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
+
+/* Hits in an order unrelated to the order of the nodes in memory */
+static double _get_hits(SymTab *tab, char **keys, int count)
+{
+	int i;
+	long found = 0;
+	double start = _now();
+	for(i = 0; i < 5 * count; ++i)
+	{
+		found += symtab_get(tab, keys[(i * 7919L) % count]) != 0;
+	}
+
+	return _now() - start + (found < 0);
+}
+
+static void _bench_compact_row(const char *name, SymTab *tab, char **keys,
+	int count)
+{
+	SymStats stats;
+	double get = _get_hits(tab, keys, count);
+	symtab_stats(tab, &stats);
+	printf("%-12s %12.0f %12zu\n", name, 5 * count / get,
+		stats.AllocatorBytes);
+}
+
+static void _bench_compact(void)
+{
+	int i, round, count = BENCH_KEYS;
+	char **keys = _keys_create(count);
+	SymTab *tab = symtab_create(count);
+	double step, slowest = 0, total = 0;
+	int steps = 0;
+
+	printf("%-12s %12s %12s\n", "tree", "gets/s", "alloc bytes");
+	_put_all(tab, keys, count);
+	_bench_compact_row("fresh", tab, keys, count);
+
+	/* Remove and put back random halves, nodes end up all over the heap */
+	srand(4321);
+	for(round = 0; round < 20; ++round)
+	{
+		for(i = 0; i < count; ++i)
+		{
+			if(rand() & 1)
+			{
+				symtab_remove(tab, keys[i]);
+			}
+		}
+
+		_put_all(tab, keys, count);
+	}
+
+	_bench_compact_row("churned", tab, keys, count);
+	do
+	{
+		step = _now();
+		i = symtab_compact(tab, 1000);
+		step = _now() - step;
+		total += step;
+		slowest = step > slowest ? step : slowest;
+		++steps;
+	}
+	while(i);
+
+	_bench_compact_row("compacted", tab, keys, count);
+	printf("%d steps of 1000 nodes, %.3f s total, slowest %.3f ms\n",
+		steps, total, slowest * 1e3);
+
+	symtab_destroy(tab);
+	_keys_destroy(keys, count);
+}
+
+#endif
+
+#if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
+
+/* Lowercases a key into a buffer before every lookup, or lets the table
+	fold it */
+static void _bench_fold(void)
+{
+	int i, j, mode, count = BENCH_KEYS;
+	char **keys = _keys_create(count);
+	char buf[64];
+	double get;
+	long found;
+
+	/* Mixed case queries */
+	for(i = 0; i < count; ++i)
+	{
+		for(j = 0; keys[i][j]; j += 2)
+		{
+			keys[i][j] = toupper((unsigned char)keys[i][j]);
+		}
+	}
+
+	for(mode = 0; mode < 2; ++mode)
+	{
+		SymTab *tab = symtab_create(count);
+		if(mode)
+		{
+			symtab_fold(tab, NULL);
+		}
+
+		for(i = 0; i < count; ++i)
+		{
+			for(j = 0; keys[i][j]; ++j)
+			{
+				buf[j] = tolower((unsigned char)keys[i][j]);
+			}
+
+			buf[j] = '\0';
+			symtab_put(tab, buf, i + 1);
+		}
+
+		/* The same node layout for both tables */
+		while(symtab_compact(tab, (size_t)-1)) {}
+		found = 0;
+		get = _now();
+		for(i = 0; i < 5 * count; ++i)
+		{
+			const char *key = keys[(i * 7919L) % count];
+			if(!mode)
+			{
+				for(j = 0; key[j]; ++j)
+				{
+					buf[j] = tolower((unsigned char)key[j]);
+				}
+
+				buf[j] = '\0';
+				key = buf;
+			}
+
+			found += symtab_get(tab, key) != 0;
+		}
+
+		get = _now() - get;
+		printf("%-28s %10.0f gets/s\n",
+			mode ? "symtab_fold" : "tolower copy", found / get);
+
+		symtab_destroy(tab);
+	}
+
+	_keys_destroy(keys, count);
+}
+
+#endif
+
+#if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
+
+/* Cost of finding the local replica, NUMA effects need a NUMA machine */
+static void _bench_replicas(void)
+{
+	int i, count = BENCH_KEYS;
+	char **keys = _keys_create(count);
+	SymTab *tab = symtab_create(count), *frozen;
+	SymReplicas *r;
+	double get;
+	long found = 0;
+
+	_put_all(tab, keys, count);
+	frozen = symtab_freeze(tab);
+	get = _get_hits(frozen, keys, count);
+	printf("%-28s %10.0f gets/s\n", "frozen", 5 * count / get);
+	symtab_destroy(frozen);
+
+	r = symtab_replicas_create(tab, 0);
+	get = _now();
+	for(i = 0; i < 5 * count; ++i)
+	{
+		found += symtab_replicas_get(r, keys[(i * 7919L) % count]) != 0;
+	}
+
+	get = _now() - get;
+	printf("%-28s %10.0f gets/s (%d replicas)\n", "replicas", found / get,
+		symtab_replicas_count(r));
+
+	symtab_replicas_destroy(r);
+	_keys_destroy(keys, count);
+}
+
+#endif
+
+#if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
+
+/* Key numbers drawn from a Zipf distribution */
+static int *_zipf_create(int keys, int count, double exponent)
+{
+	double *cdf = malloc(keys * sizeof(*cdf)), sum = 0;
+	int *order = malloc(count * sizeof(*order));
+	int i;
+
+	for(i = 0; i < keys; ++i)
+	{
+		sum += pow(i + 1, -exponent);
+		cdf[i] = sum;
+	}
+
+	srand(5678);
+	for(i = 0; i < count; ++i)
+	{
+		double r = (double)rand() / RAND_MAX * sum;
+		int lo = 0, hi = keys - 1;
+		while(lo < hi)
+		{
+			int mid = (lo + hi) / 2;
+			if(cdf[mid] < r)
+			{
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+
+		order[i] = lo;
+	}
+
+	free(cdf);
+	return order;
+}
+
+/* Skewed lookups with and without the hot cache */
+static void _bench_hot(void)
+{
+	static const double exponents[] = { 1.0, 1.5 };
+	int i, e, hot, count = BENCH_KEYS, gets = 5 * BENCH_KEYS;
+	char **keys = _keys_create(count);
+	char name[32];
+	int *order;
+	SymHotStats stats;
+	double get;
+	long found;
+
+	for(e = 0; e < 2; ++e)
+	{
+		order = _zipf_create(count, gets, exponents[e]);
+		for(hot = 0; hot < 2; ++hot)
+		{
+			SymTab *tab = symtab_create(count);
+			if(hot)
+			{
+				symtab_hot_cache(tab);
+			}
+
+			_put_all(tab, keys, count);
+			found = 0;
+			get = _now();
+			for(i = 0; i < gets; ++i)
+			{
+				found += symtab_get(tab, keys[order[i]]) != 0;
+			}
+
+			get = _now() - get;
+			symtab_hot_stats(tab, &stats);
+			sprintf(name, "zipf %.1f %s", exponents[e],
+				hot ? "hot cache" : "tree");
+			printf("%-28s %10.0f gets/s", name, found / get);
+			if(hot)
+			{
+				printf(", %.1f %% hits", 100.0 * stats.Hits /
+					(stats.Hits + stats.Misses));
+			}
+
+			printf("\n");
+			symtab_destroy(tab);
+		}
+
+		free(order);
+	}
+
+	_keys_destroy(keys, count);
+}
+
+/* Counter of the dTLB load misses of this thread, -1 if there is none
+	(no PMU in a virtual machine, or perf_event_paranoid forbids it) */
+static int _tlb_open(void)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_DTLB |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif /* __linux__ */
+}
+
+/* Memory of this process in transparent huge pages, -1 if unknown */
+static long _thp_kb(void)
+{
+	char line[128];
+	long kb = -1;
+	FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+	if(!fp)
+	{
+		return -1;
+	}
+
+	while(fgets(line, sizeof(line), fp))
+	{
+		if(sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+		{
+			break;
+		}
+	}
+
+	fclose(fp);
+	return kb;
+}
+
+static void _bench_huge_row(const char *name, SymTab *tab, char **keys,
+	int count, int tlb)
+{
+	uint64_t misses = 0;
+	double get;
+
+#ifdef __linux__
+	if(tlb >= 0)
+	{
+		ioctl(tlb, PERF_EVENT_IOC_RESET, 0);
+		ioctl(tlb, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif /* __linux__ */
+
+	get = _get_hits(tab, keys, count);
+
+#ifdef __linux__
+	if(tlb >= 0)
+	{
+		ioctl(tlb, PERF_EVENT_IOC_DISABLE, 0);
+		if(read(tlb, &misses, sizeof(misses)) != sizeof(misses))
+		{
+			misses = 0;
+		}
+	}
+#endif /* __linux__ */
+
+	printf("%-16s %12.0f ", name, 5 * count / get);
+	if(tlb >= 0)
+	{
+		printf("%14.3f", misses / (5.0 * count));
+	}
+	else
+	{
+		printf("%14s", "n/a");
+	}
+
+	printf(" %10ld\n", _thp_kb());
+}
+
+/* Random lookups in a table that is too large for the TLB, with the nodes
+	in normal and in huge pages */
+static void _bench_huge(void)
+{
+	int count = 5 * BENCH_KEYS, tlb = _tlb_open();
+	char **keys = _keys_create(count);
+	SymTab *tab, *frozen;
+	int huge;
+
+	printf("%-16s %12s %14s %10s\n", "tree", "gets/s", "dTLB miss/get",
+		"THP kB");
+
+	for(huge = 0; huge < 2; ++huge)
+	{
+		tab = symtab_create(count);
+		if(huge)
+		{
+			symtab_huge_pages(tab);
+		}
+		else
+		{
+			_put_all(tab, keys, count);
+			_bench_huge_row("heap", tab, keys, count, tlb);
+			symtab_destroy(tab);
+			tab = symtab_create(count);
+		}
+
+		_put_all(tab, keys, count);
+		while(symtab_compact(tab, (size_t)-1)) {}
+		_bench_huge_row(huge ? "compacted huge" : "compacted", tab, keys,
+			count, tlb);
+
+		frozen = symtab_freeze(tab);
+		symtab_destroy(tab);
+		_bench_huge_row(huge ? "frozen huge" : "frozen", frozen, keys,
+			count, tlb);
+		symtab_destroy(frozen);
+	}
+
+	if(tlb >= 0)
+	{
+		close(tlb);
+	}
+
+	_keys_destroy(keys, count);
+}
+
+#endif
+
+static void _scan_count(void *data, size_t offset, size_t len, int value)
+{
+	++*(long *)data;
+	(void)offset;
+	(void)len;
+	(void)value;
+}
+
+/* Random lowercase words, every 16th one is a keyword */
+static char *_text_create(char **keys, int count, size_t len)
+{
+	char *text = malloc(len + 64);
+	size_t pos = 0;
+	int n = 0;
+	while(pos < len)
+	{
+		if(++n % 16 == 0)
+		{
+			pos += sprintf(text + pos, "%s ", keys[rand() % count]);
+		}
+		else
+		{
+			int i, word = 3 + rand() % 8;
+			for(i = 0; i < word; ++i)
+			{
+				text[pos++] = 'a' + rand() % 26;
+			}
+
+			text[pos++] = ' ';
+		}
+	}
+
+	return text;
+}
+
+static void _bench_scan(void)
+{
+	int count = 1000;
+	size_t len = 64 << 20;
+	size_t naive_len = 1 << 20;
+	char **keys = _keys_create(count);
+	char *text = _text_create(keys, count, len);
+	SymTab *tab = symtab_create(count);
+	long matches = 0, naive_matches = 0;
+	size_t pos, max_len = 0;
+	double start, scan, naive;
+	int i;
+
+	for(i = 0; i < count; ++i)
+	{
+		size_t key_len = strlen(keys[i]);
+		symtab_put(tab, keys[i], i + 1);
+		if(key_len > max_len)
+		{
+			max_len = key_len;
+		}
+	}
+
+	start = _now();
+	symtab_scan(tab, text, len, &matches, _scan_count);
+	scan = _now() - start;
+
+	/* symtab_get on every substring up to the longest key */
+	start = _now();
+	for(pos = 0; pos < naive_len; ++pos)
+	{
+		char buf[64];
+		size_t n;
+		for(n = 1; n <= max_len && pos + n <= naive_len; ++n)
+		{
+			memcpy(buf, text + pos, n);
+			buf[n] = '\0';
+			naive_matches += symtab_get(tab, buf) != 0;
+		}
+	}
+
+	naive = _now() - start;
+
+	printf("%-28s %10.1f MB/s, %ld matches\n", "symtab_scan",
+		len / scan / 1e6, matches);
+	printf("%-28s %10.1f MB/s, %ld matches in the first MB\n",
+		"symtab_get per substring", naive_len / naive / 1e6, naive_matches);
+
+	symtab_destroy(tab);
+	free(text);
+	_keys_destroy(keys, count);
+}
+
+static const Benchmark _benchmarks[] =
+{
+#if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
+	{ "wal", _bench_wal },
+	{ "bloom", _bench_bloom },
+	{ "parallel", _bench_parallel },
+	{ "compress", _bench_compress },
+	{ "compact", _bench_compact },
+	{ "fold", _bench_fold },
+	{ "replicas", _bench_replicas },
+	{ "huge", _bench_huge },
+	{ "hot", _bench_hot },
+#endif
+	{ "scan", _bench_scan },
+	{ NULL, NULL }
+};
+
+/* --- PUBLIC --- */
+void bench_run(const char *name)
+{
+	const Benchmark *b;
+	for(b = _benchmarks; b->Name; ++b)
+	{
+		if(!name || !strcmp(name, b->Name))
+		{
+			printf("\n%s\n", b->Name);
+			b->Run();
+		}
+	}
+}
@@ -0,0 +1,19 @@
+/**
+ * @file    bench.h
+ * @author  Anton Tchekov
+ * @version 0.1
+ * @date    2023-09-02
+ * @brief   Symbol table benchmarks
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+/**
+ * @brief Runs a benchmark and prints the results
+ *
+ * @param name Name of the benchmark, or NULL to run all of them
+ */
+void bench_run(const char *name);
+
+#endif /* __BENCH_H__ */
@@ -10,30 +10,215 @@
 
 #if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
 
+#include "symtab_impl.h"
+#include "symtab_pool.h"
+
+#define SYMTAB_MATCH_MAX 63
+
+/* Bloom filter: bits per symbol, bits set per symbol, bits per block */
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_HASHES       6
+#define BLOOM_BLOCK_BITS   512
+
+/* Perfect hash index: average symbols per bucket, seeds tried per bucket */
+#define HASH_BUCKET_KEYS 4
+#define HASH_MAX_SEED    (1 << 20)
+
+/* Label compression: keys up to this size are encoded on the stack,
+	number of samples and size of the table used for training */
+#define DICT_BUFFER  256
+#define DICT_SAMPLES 1024
+#define DICT_TABLE   (1 << 18)
+
+/* Compaction: size and alignment of the arena chunks */
+#define ARENA_CHUNK (64 * 1024)
+
+/* Huge pages: size of a page, which is also the size of a chunk */
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+/* Parallel operations split the tree into this many subtrees per thread */
+#define PARALLEL_TASKS 16
+
 #ifdef SYMTAB_DEBUG
 #include <stdio.h>
 #endif /* SYMTAB_DEBUG */
 
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif /* __GLIBC__ */
+
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/mman.h>
 
-/**
- * sizeof(SYMTAB):
- *   - 64-bit: 20 bytes
- *   - 32-bit: 12 bytes
- *
- * plus a variable number of bytes for the flexible array member
- */
-struct SYMTAB
+#ifdef SYMTAB_STATS
+#define STAT(x) x
+#else
+#define STAT(x)
+#endif /* SYMTAB_STATS */
+
+/* Growable buffer for building complete identifiers during traversal */
+typedef struct
+{
+	char *Buffer;
+	size_t Capacity;
+} SymKey;
+
+/* Glob pattern compiled to a bit-parallel NFA. Bit i of a state is set when
+	token i is the next one to match, `Accept[c]` has the bits of all tokens
+	that can consume the byte c and `Star` those of the `*` tokens */
+typedef struct
+{
+	uint64_t Accept[256];
+	uint64_t Star;
+	uint64_t Final;
+	int Results;
+	SymKey Key;
+	void *Data;
+	void (*Callback)(void *data, const char *ident, int value);
+} SymMatch;
+
+/* State of a fuzzy search, `Rows` holds one Levenshtein row
+	per character of the current key */
+typedef struct
+{
+	const char *Query;
+	int Length;
+	int MaxEdits;
+	int MaxResults;
+	int Results;
+	int *Rows;
+	size_t RowCount;
+	SymKey Key;
+	void *Data;
+	void (*Callback)(void *data, const char *ident, int value, int distance);
+} SymFuzzy;
+
+/* Pre-order traversal with an explicit stack instead of recursion, the
+	stack holds one frame per level for the siblings still to visit */
+typedef struct
+{
+	const SymNode *Node;
+	size_t Length;
+	size_t Depth;
+	int First;
+	int Escape;
+} SymIterFrame;
+
+/* With a `Dict`, the keys are decoded. `Escape` is set when the label
+	above a frame ended in the middle of an escape sequence. */
+typedef struct
+{
+	SymIterFrame *Stack;
+	size_t Top;
+	size_t Capacity;
+	SymKey Key;
+	const SymDict *Dict;
+	int Pushed;
+} SymIter;
+
+/* Symbol of a perfect hash index under construction */
+typedef struct
 {
-	struct SYMTAB *Next;
-	struct SYMTAB *Children;
+	uint64_t Hash;
+	uint32_t Bucket;
+	const char *Key;
 	int Value;
-	char Label[];
-};
+} SymHashKey;
+
+/* Substring of the samples that is a candidate for the dictionary */
+typedef struct
+{
+	const char *Start;
+	size_t Length;
+	unsigned long Count;
+} SymWord;
+
+/* Completion or prefix iteration of a compressed table, `Common` is the
+	common prefix of the symbols found so far and `Length` its length */
+typedef struct
+{
+	char *Ident;
+	size_t Length;
+	SymKey Common;
+	int Results;
+	int MaxResults;
+	void *Data;
+	void (*Callback)(void *data, char *ident);
+} SymDictPrefix;
+
+/* Node to copy into a frozen table, and the pointer to set to the copy */
+typedef struct
+{
+	const SymNode *Node;
+	SymNode **Link;
+} SymFreeze;
+
+/* Pointer to a node to compact, and the length of the key above it */
+typedef struct
+{
+	SymNode **Link;
+	size_t Length;
+} SymCompactFrame;
+
+/* Pending nodes of a compaction pass in pre-order, and the current key */
+typedef struct
+{
+	SymCompactFrame *Stack;
+	size_t Top;
+	size_t Capacity;
+	SymKey Key;
+} SymCompact;
+
+/* Subtree for a worker of a parallel operation: a node with its children
+	but not its siblings. `Key` is the offset of the key above the node
+	in the key buffer of the task list, `Length` its length. */
+typedef struct
+{
+	SymNode *Node;
+	size_t Key;
+	size_t Length;
+	size_t Depth;
+} SymTask;
+
+typedef struct
+{
+	SymTask *Tasks;
+	size_t Count;
+	size_t Capacity;
+	SymKey Keys;
+	size_t KeysLength;
+} SymTasks;
+
+/* State of a parallel operation, results are kept per worker */
+typedef struct
+{
+	const SymTab *Tab;
+	const SymTasks *Tasks;
+	SymStats *Stats;
+	SymTab *Sinks;
+	SymKey *Keys;
+	int *Results;
+	void *Data;
+	void (*Callback)(void *data, int worker, const char *ident, int value);
+	const char *const *Idents;
+	const int *Values;
+	const size_t *Order;
+	const size_t *Start;
+	SymTab **Tabs;
+} SymParallel;
 
-typedef struct SYMTAB SymNode;
+/* Victims collected by one sweep of the CLOCK hand */
+typedef struct
+{
+	SymKey Key;
+	char **Victims;
+	size_t Count;
+	size_t Need;
+	SymHot *Hot;
+	const unsigned char *Fold;
+} SymClock;
 
 /* --- PRIVATE --- */
 static size_t _calc_size(size_t count)
@@ -41,145 +226,2752 @@ static size_t _calc_size(size_t count)
 	return offsetof(SymNode, Label) + count;
 }
 
-static SymNode *_entry_new(size_t label_size)
-{
-	SymNode *n = malloc(_calc_size(label_size));
-	n->Next = NULL;
-	n->Children = NULL;
-	return n;
+static inline size_t _node_size(const SymNode *entry)
+{
+	return _calc_size(strlen(entry->Label) + 1);
+}
+
+/* Size of a node in a frozen table or arena, where nodes follow each other */
+static size_t _frozen_size(const SymNode *entry)
+{
+	return (_node_size(entry) + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
+/* Maps `size` bytes rounded up to huge pages, aligned to a huge page:
+	explicit huge pages if the system has some free, otherwise normal pages
+	that the kernel may back with transparent huge pages */
+static void *_huge_alloc(size_t size, size_t *mapped)
+{
+	size_t len = (size + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+	size_t head;
+	char *p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif /* MAP_HUGETLB */
+
+	if(p == MAP_FAILED)
+	{
+		/* Map one page more and unmap the ends to align it */
+		p = mmap(NULL, len + HUGE_PAGE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(p == MAP_FAILED)
+		{
+			return NULL;
+		}
+
+		head = (HUGE_PAGE - (uintptr_t)p % HUGE_PAGE) % HUGE_PAGE;
+		if(head)
+		{
+			munmap(p, head);
+		}
+
+		p += head;
+		munmap(p + len, HUGE_PAGE - head);
+#ifdef MADV_HUGEPAGE
+		madvise(p, len, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+	}
+
+	*mapped = len;
+	return p;
+}
+
+/* Memory for the block or hash index of a frozen table, `mapped` is the
+	size of the mapping or 0 if it is from the heap */
+static void *_block_alloc(int huge, size_t size, size_t *mapped)
+{
+	void *p = NULL;
+	*mapped = 0;
+	if(huge)
+	{
+		p = _huge_alloc(size, mapped);
+	}
+
+	return p ? p : malloc(size);
+}
+
+static void _block_free(void *p, size_t mapped)
+{
+	if(mapped)
+	{
+		munmap(p, mapped);
+	}
+	else
+	{
+		free(p);
+	}
+}
+
+static inline SymArena *_arena_of(const SymNode *entry)
+{
+	uintptr_t chunk = (entry->Flags & NODE_HUGE) ? HUGE_PAGE : ARENA_CHUNK;
+	return (SymArena *)((uintptr_t)entry & ~(chunk - 1));
+}
+
+/* Drops a node or the table's reference to a chunk */
+static void _arena_unref(SymArena *arena)
+{
+	if(!__atomic_sub_fetch(&arena->Live, 1, __ATOMIC_ACQ_REL))
+	{
+		if(arena->Mapped)
+		{
+			munmap(arena, arena->Size);
+		}
+		else
+		{
+			free(arena);
+		}
+	}
+}
+
+/* Starts a chunk of `size` bytes, in huge pages if the table uses them
+	and they can be mapped */
+static SymArena *_arena_new(const SymTab *tab, size_t size)
+{
+	SymArena *arena = NULL;
+	size_t mapped;
+	if(tab->Huge)
+	{
+		arena = _huge_alloc(size, &mapped);
+	}
+
+	if(arena)
+	{
+		arena->Mapped = 1;
+	}
+	else
+	{
+		arena = aligned_alloc(size, size);
+		arena->Mapped = 0;
+	}
+
+	arena->Live = 1;
+	arena->Used = sizeof(SymArena);
+	arena->Size = size;
+	arena->Pass = tab->Pass;
+	return arena;
+}
+
+/* Returns memory for a copy of `entry` in the table's current chunk,
+	or NULL if the node is too large for a chunk */
+static SymNode *_arena_alloc(SymTab *tab, const SymNode *entry)
+{
+	size_t size = _frozen_size(entry);
+	size_t chunk = tab->Huge ? HUGE_PAGE : ARENA_CHUNK;
+	SymNode *n;
+	if(size > chunk - sizeof(SymArena))
+	{
+		return NULL;
+	}
+
+	/* A new chunk also when huge pages were switched on */
+	if(!tab->Arena || tab->Arena->Used + size > tab->Arena->Size ||
+		tab->Arena->Size != chunk)
+	{
+		if(tab->Arena)
+		{
+			_arena_unref(tab->Arena);
+		}
+
+		tab->Arena = _arena_new(tab, chunk);
+	}
+
+	n = (SymNode *)((char *)tab->Arena + tab->Arena->Used);
+	tab->Arena->Used += size;
+	__atomic_add_fetch(&tab->Arena->Live, 1, __ATOMIC_RELAXED);
+	return n;
+}
+
+static void *_node_alloc(SymTab *tab, size_t size)
+{
+	tab->Bytes += size;
+	return malloc(size);
+}
+
+/* Frees the memory of a node without counting it */
+static void _node_dispose(SymNode *entry)
+{
+	if(entry->Flags & NODE_ARENA)
+	{
+		_arena_unref(_arena_of(entry));
+	}
+	else
+	{
+		free(entry);
+	}
+}
+
+static SymNode *_node_resize(SymTab *tab, SymNode *entry,
+	size_t old_size, size_t size)
+{
+	SymNode *n;
+	tab->Bytes += size - old_size;
+	if(!(entry->Flags & NODE_ARENA))
+	{
+		return realloc(entry, size);
+	}
+
+	/* Nodes in an arena shrink in place and move to the heap to grow */
+	if(size <= old_size)
+	{
+		return entry;
+	}
+
+	n = malloc(size);
+	memcpy(n, entry, old_size);
+	n->Flags &= ~(NODE_ARENA | NODE_HUGE);
+	_node_dispose(entry);
+	return n;
+}
+
+static void _node_free(SymTab *tab, SymNode *entry)
+{
+	tab->Bytes -= _node_size(entry);
+	_node_dispose(entry);
+}
+
+static SymNode *_entry_new(SymTab *tab, size_t label_size)
+{
+	SymNode *n = _node_alloc(tab, _calc_size(label_size));
+	n->Next = NULL;
+	n->Children = NULL;
+	n->RefCount = 1;
+	n->Flags = NODE_REFERENCED;
+	return n;
+}
+
+static inline void _node_ref(SymNode *entry)
+{
+	if(entry)
+	{
+		__atomic_add_fetch(&entry->RefCount, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* Drops a reference, returns 1 if it was the last one */
+static inline int _node_unref(SymNode *entry)
+{
+	return !__atomic_sub_fetch(&entry->RefCount, 1, __ATOMIC_ACQ_REL);
+}
+
+/* Takes over a reference, returns the node if it is owned now */
+static inline SymNode *_node_own(SymNode *entry)
+{
+	/* Nodes linked in by a rotation below are already owned (count 0) */
+	if(entry && (!__atomic_load_n(&entry->RefCount, __ATOMIC_ACQUIRE) ||
+		_node_unref(entry)))
+	{
+		return entry;
+	}
+
+	return NULL;
+}
+
+/**
+ * Frees up to `budget` nodes of the owned node `entry` and everything only
+ * reachable through it, without recursion or a stack: While the node has
+ * an owned child, the child is rotated up (the child's siblings become the
+ * node's children and the node becomes the child's next sibling), so all
+ * pending work is always on the `Next` list of the current node.
+ *
+ * Returns the node to continue with, or NULL when everything is freed.
+ */
+static SymNode *_node_release_step(SymTab *tab, SymNode *entry,
+	size_t budget)
+{
+	while(entry && budget)
+	{
+		SymNode *child = entry->Children;
+		if(!child)
+		{
+			SymNode *next = entry->Next;
+			_node_free(tab, entry);
+			entry = _node_own(next);
+			--budget;
+		}
+		else if(_node_unref(child))
+		{
+			entry->Children = child->Next;
+			child->Next = entry;
+			entry = child;
+		}
+		else
+		{
+			entry->Children = NULL;
+		}
+	}
+
+	return entry;
+}
+
+static void _node_release(SymTab *tab, SymNode *entry)
+{
+	if(entry && _node_unref(entry))
+	{
+		_node_release_step(tab, entry, (size_t)-1);
+	}
+}
+
+static inline int _is_shared(const SymNode *entry)
+{
+	return __atomic_load_n(&entry->RefCount, __ATOMIC_ACQUIRE) > 1;
+}
+
+static SymNode *_node_copy(SymTab *tab, SymNode *entry)
+{
+	size_t size = _node_size(entry);
+	SymNode *copy = _node_alloc(tab, size);
+	memcpy(copy, entry, size);
+	copy->RefCount = 1;
+	copy->Flags &= ~(NODE_ARENA | NODE_HUGE);
+	_node_ref(copy->Next);
+	_node_ref(copy->Children);
+	_node_release(tab, entry);
+	return copy;
+}
+
+/* Makes the node `*ref` points to private to this table (path copying) */
+static SymNode *_node_unique(SymTab *tab, SymNode **ref)
+{
+	SymNode *entry = *ref;
+	if(entry && _is_shared(entry))
+	{
+		entry = _node_copy(tab, entry);
+		*ref = entry;
+	}
+
+	return entry;
+}
+
+static inline int _is_leaf(const SymNode *entry)
+{
+	return entry->Value;
+}
+
+static inline int _is_last(const SymNode *entry)
+{
+	return entry->Next == NULL;
+}
+
+static inline int _has_children(const SymNode *entry)
+{
+	return entry->Children != NULL;
+}
+
+static inline int _has_exactly_one_child(const SymNode *entry)
+{
+	return _has_children(entry) && _is_last(entry->Children);
+}
+
+/* Length of the common prefix of a label and a key, the bytes of the key
+	are folded with `fold` if it is set */
+static inline size_t _common(const char *label, const char *key,
+	const unsigned char *fold)
+{
+	const char *edge = label;
+	if(fold)
+	{
+		/* Labels are folded, bytes that are equal need no lookup */
+		while(*edge && (*edge == *key ||
+			*edge == (char)fold[(unsigned char)*key]))
+		{
+			++edge;
+			++key;
+		}
+	}
+	else
+	{
+		while(*edge && *edge == *key)
+		{
+			++edge;
+			++key;
+		}
+	}
+
+	return edge - label;
+}
+
+static void _fold(char *s, const unsigned char *fold)
+{
+	if(fold)
+	{
+		for(; *s; ++s)
+		{
+			*s = fold[(unsigned char)*s];
+		}
+	}
+}
+
+/* Labels of a table with folding are stored folded */
+static SymNode *_new_leaf(SymTab *tab, const char *label, int value)
+{
+	size_t label_size = strlen(label) + 1;
+	SymNode *n = _entry_new(tab, label_size);
+	memcpy(n->Label, label, label_size);
+	_fold(n->Label, tab->Fold);
+	n->Value = value;
+	return n;
+}
+
+static SymNode *_entry_split(SymTab *tab, SymNode *entry, char *pos,
+	SymNode **child)
+{
+	size_t old_size = _node_size(entry);
+	SymNode *second = _new_leaf(tab, pos, entry->Value);
+	*pos = '\0';
+	second->Children = entry->Children;
+	second->Flags = entry->Flags & NODE_REFERENCED;
+	entry->Children = second;
+	*child = second;
+	return _node_resize(tab, entry, old_size,
+		_calc_size(pos - entry->Label + 1));
+}
+
+static SymNode *_entry_split_for_child(SymTab *tab,
+	SymNode *entry, char *pos, const char *label, int value)
+{
+	SymNode *n = _new_leaf(tab, label, value);
+	SymNode *second;
+	entry = _entry_split(tab, entry, pos, &second);
+	entry->Value = 0;
+	second->Next = n;
+	return entry;
+}
+
+static SymNode *_entry_split_for_prefix(SymTab *tab,
+	SymNode *entry, char *pos, int value)
+{
+	SymNode *second;
+	entry = _entry_split(tab, entry, pos, &second);
+	entry->Value = value;
+	return entry;
+}
+
+static SymNode *_entry_merge(SymTab *tab, SymNode *parent, SymNode *child)
+{
+	size_t parent_len = strlen(parent->Label);
+	size_t child_len = strlen(child->Label);
+	SymNode *merge = _node_resize(tab, parent, _calc_size(parent_len + 1),
+		_calc_size(parent_len + child_len + 1));
+	merge->Value = child->Value;
+	merge->Children = child->Children;
+	merge->Flags = (merge->Flags & (NODE_ARENA | NODE_HUGE)) |
+		(child->Flags & NODE_REFERENCED);
+	memcpy(merge->Label + parent_len, child->Label, child_len + 1);
+	if(_is_shared(child))
+	{
+		_node_ref(child->Children);
+		_node_release(tab, child);
+	}
+	else
+	{
+		_node_free(tab, child);
+	}
+
+	return merge;
+}
+
+static void _entry_remove(SymTab *tab,
+	SymNode *entry, SymNode **entry_ref,
+	SymNode *parent, SymNode **parent_ref)
+{
+	if(_has_children(entry))
+	{
+		entry->Value = 0;
+		if(_is_last(entry->Children))
+		{
+			*entry_ref = _entry_merge(tab, entry, entry->Children);
+		}
+	}
+	else
+	{
+		*entry_ref = entry->Next;
+		_node_free(tab, entry);
+	}
+
+	if(!_is_leaf(parent) && _has_exactly_one_child(parent))
+	{
+		*parent_ref = _entry_merge(tab, parent, parent->Children);
+	}
+}
+
+static const SymNode *_find(const SymNode *entry, const char *ident,
+	const unsigned char *fold, unsigned long *visits)
+{
+	/* Siblings differ in the first byte, which is folded once per level */
+	char first = fold ? fold[(unsigned char)*ident] : *ident;
+	while(entry)
+	{
+		STAT(++*visits);
+		if(*entry->Label && *entry->Label != first)
+		{
+			entry = entry->Next;
+			continue;
+		}
+
+		size_t n = _common(entry->Label, ident, fold);
+		const char *search = ident + n;
+		const char *edge = entry->Label + n;
+
+		if(!*edge)
+		{
+			if(!*search && _is_leaf(entry))
+			{
+				return entry;
+			}
+
+			ident = search;
+			first = fold ? fold[(unsigned char)*ident] : *ident;
+			entry = entry->Children;
+		}
+		else
+		{
+			entry = entry->Next;
+		}
+	}
+
+	return NULL;
+	(void)visits;
+}
+
+static void _key_reserve(SymKey *key, size_t size)
+{
+	if(size > key->Capacity)
+	{
+		key->Capacity = 2 * size;
+		key->Buffer = realloc(key->Buffer, key->Capacity);
+	}
+}
+
+/* Appends the decoded `label` to the key of length `len`, returns the new
+	length. `escape` is the escape state before and after the label, as
+	a split can separate an escape byte from the byte it escapes. */
+static size_t _dict_decode(const SymDict *dict, SymKey *key, size_t len,
+	const char *label, int *escape)
+{
+	const unsigned char *p = (const unsigned char *)label;
+	for(; *p; ++p)
+	{
+		_key_reserve(key, len + DICT_MAX + 1);
+		if(*escape || *p < DICT_FIRST)
+		{
+			key->Buffer[len++] = *p;
+			*escape = 0;
+		}
+		else if(*p == DICT_ESCAPE)
+		{
+			*escape = 1;
+		}
+		else
+		{
+			memcpy(key->Buffer + len, dict->Words[*p - DICT_FIRST],
+				dict->Length[*p - DICT_FIRST]);
+			len += dict->Length[*p - DICT_FIRST];
+		}
+	}
+
+	_key_reserve(key, len + 1);
+	key->Buffer[len] = '\0';
+	return len;
+}
+
+static SymDict *_dict_copy(const SymDict *dict)
+{
+	SymDict *copy = NULL;
+	if(dict)
+	{
+		copy = malloc(sizeof(*copy));
+		memcpy(copy, dict, sizeof(*copy));
+	}
+
+	return copy;
+}
+
+/* Decodes a complete key into a new string */
+static char *_dict_text(const SymDict *dict, const char *ident)
+{
+	SymKey key;
+	int escape = 0;
+	key.Buffer = NULL;
+	key.Capacity = 0;
+	_dict_decode(dict, &key, 0, ident, &escape);
+	return key.Buffer;
+}
+
+/* Replaces the longest dictionary word at each position by its code */
+static char *_dict_encode(const SymDict *dict, const char *ident,
+	char *buf, size_t size)
+{
+	const unsigned char *p = (const unsigned char *)ident;
+	size_t len = strlen(ident);
+	char *out = 2 * len + 1 > size ? malloc(2 * len + 1) : buf;
+	char *q = out;
+	while(*p)
+	{
+		int i = dict->First[*p];
+		while(i && strncmp(dict->Words[i - 1], (const char *)p,
+			dict->Length[i - 1]))
+		{
+			i = dict->Next[i - 1];
+		}
+
+		if(i)
+		{
+			*q++ = DICT_FIRST + i - 1;
+			p += dict->Length[i - 1];
+		}
+		else
+		{
+			if(*p >= DICT_FIRST)
+			{
+				*q++ = (char)DICT_ESCAPE;
+			}
+
+			*q++ = *p++;
+		}
+	}
+
+	*q = '\0';
+	return out;
+}
+
+/* Key as stored in the tree, must be released with _key_done */
+static const char *_key_encode(const SymTab *tab, const char *ident,
+	char *buf)
+{
+	return tab->Dict ? _dict_encode(tab->Dict, ident, buf, DICT_BUFFER) :
+		ident;
+}
+
+static void _key_done(const char *key, const char *ident, const char *buf)
+{
+	if(key != ident && key != buf)
+	{
+		free((char *)key);
+	}
+}
+
+static void _iter_push(SymIter *it, const SymNode *entry, size_t len,
+	size_t depth, int first, int escape)
+{
+	SymIterFrame *frame;
+	if(it->Top == it->Capacity)
+	{
+		it->Capacity = it->Capacity ? 2 * it->Capacity : 32;
+		it->Stack = realloc(it->Stack, it->Capacity * sizeof(*it->Stack));
+	}
+
+	frame = it->Stack + it->Top++;
+	frame->Node = entry;
+	frame->Length = len;
+	frame->Depth = depth;
+	frame->First = first;
+	frame->Escape = escape;
+}
+
+static void _iter_init(SymIter *it, const SymNode *entry)
+{
+	it->Stack = NULL;
+	it->Top = 0;
+	it->Capacity = 0;
+	it->Key.Buffer = NULL;
+	it->Key.Capacity = 0;
+	it->Dict = NULL;
+	it->Pushed = 0;
+	if(entry)
+	{
+		_iter_push(it, entry, 0, 1, 1, 0);
+	}
+}
+
+static void _iter_free(SymIter *it)
+{
+	free(it->Stack);
+	free(it->Key.Buffer);
+}
+
+/* Returns the next node in pre-order and builds its full key in `it->Key`,
+	`frame` receives the depth and whether the node starts a sibling list */
+static const SymNode *_iter_next(SymIter *it, SymIterFrame *frame)
+{
+	const SymNode *entry;
+	size_t label_len;
+	int escape;
+	if(!it->Top)
+	{
+		return NULL;
+	}
+
+	*frame = it->Stack[--it->Top];
+	entry = frame->Node;
+	escape = frame->Escape;
+	if(it->Dict)
+	{
+		label_len = _dict_decode(it->Dict, &it->Key, frame->Length,
+			entry->Label, &escape) - frame->Length;
+	}
+	else
+	{
+		label_len = strlen(entry->Label);
+		_key_reserve(&it->Key, frame->Length + label_len + 1);
+		memcpy(it->Key.Buffer + frame->Length, entry->Label, label_len + 1);
+	}
+
+	if(entry->Next)
+	{
+		_iter_push(it, entry->Next, frame->Length, frame->Depth, 0,
+			frame->Escape);
+	}
+
+	it->Pushed = entry->Children != NULL;
+	if(entry->Children)
+	{
+		_iter_push(it, entry->Children, frame->Length + label_len,
+			frame->Depth + 1, 1, escape);
+	}
+
+	return entry;
+}
+
+/* Skips the children of the node last returned by _iter_next */
+static void _iter_skip(SymIter *it)
+{
+	if(it->Pushed)
+	{
+		--it->Top;
+		it->Pushed = 0;
+	}
+}
+
+/* Calls `callback` for every symbol below `entry` in tree order,
+	with decoded keys if `dict` is set */
+static int _walk(const SymNode *entry, const SymDict *dict,
+	void *data, int (*callback)(void *data, const char *ident, int value))
+{
+	SymIter it;
+	SymIterFrame frame;
+	int rv = 0;
+	_iter_init(&it, entry);
+	it.Dict = dict;
+	while(!rv && (entry = _iter_next(&it, &frame)))
+	{
+		if(_is_leaf(entry))
+		{
+			rv = callback(data, it.Key.Buffer, entry->Value);
+		}
+	}
+
+	_iter_free(&it);
+	return rv;
+}
+
+/* Compiles a glob pattern into a bit-parallel NFA with one state per token,
+	returns the number of tokens or -1 if the pattern is invalid or too long */
+static int _match_compile(SymMatch *m, const char *pattern)
+{
+	const unsigned char *p = (const unsigned char *)pattern;
+	int n = 0;
+
+	memset(m->Accept, 0, sizeof(m->Accept));
+	m->Star = 0;
+	while(*p)
+	{
+		uint64_t bit = (uint64_t)1 << n;
+		int c;
+		if(n >= SYMTAB_MATCH_MAX)
+		{
+			return -1;
+		}
+
+		if(*p == '*')
+		{
+			m->Star |= bit;
+			++p;
+		}
+		else if(*p == '?')
+		{
+			for(c = 1; c < 256; ++c)
+			{
+				m->Accept[c] |= bit;
+			}
+
+			++p;
+		}
+		else if(*p == '[')
+		{
+			int negate = 0;
+			unsigned char set[256] = { 0 };
+			++p;
+			if(*p == '!' || *p == '^')
+			{
+				negate = 1;
+				++p;
+			}
+
+			/* A leading ']' is part of the set */
+			do
+			{
+				int first, last;
+				if(!*p)
+				{
+					return -1;
+				}
+
+				first = last = *p++;
+				if(p[0] == '-' && p[1] && p[1] != ']')
+				{
+					last = p[1];
+					p += 2;
+				}
+
+				for(c = first; c <= last; ++c)
+				{
+					set[c] = 1;
+				}
+			}
+			while(*p != ']');
+
+			++p;
+			for(c = 1; c < 256; ++c)
+			{
+				if(set[c] != negate)
+				{
+					m->Accept[c] |= bit;
+				}
+			}
+		}
+		else
+		{
+			if(*p == '\\' && p[1])
+			{
+				++p;
+			}
+
+			m->Accept[*p++] |= bit;
+		}
+
+		++n;
+	}
+
+	m->Final = (uint64_t)1 << n;
+	return n;
+}
+
+/* Adds the states reachable by letting a star match nothing */
+static inline uint64_t _match_closure(const SymMatch *m, uint64_t state)
+{
+	uint64_t prev;
+	do
+	{
+		prev = state;
+		state |= (state & m->Star) << 1;
+	}
+	while(state != prev);
+	return state;
+}
+
+static inline uint64_t _match_step(const SymMatch *m, uint64_t state,
+	unsigned char c)
+{
+	return _match_closure(m,
+		((state & m->Accept[c]) << 1) | (state & m->Star));
+}
+
+static void _match(SymMatch *m, const SymNode *entry, size_t len,
+	uint64_t state)
+{
+	while(entry)
+	{
+		const char *edge = entry->Label;
+		size_t depth = len;
+		uint64_t s = state;
+		while(*edge && s)
+		{
+			_key_reserve(&m->Key, depth + 2);
+			m->Key.Buffer[depth++] = *edge;
+			s = _match_step(m, s, *edge++);
+		}
+
+		/* No key below this node can match the pattern */
+		if(s)
+		{
+			m->Key.Buffer[depth] = '\0';
+			if(_is_leaf(entry) && (s & m->Final))
+			{
+				m->Callback(m->Data, m->Key.Buffer, entry->Value);
+				++m->Results;
+			}
+
+			_match(m, entry->Children, depth, s);
+		}
+
+		entry = entry->Next;
+	}
+}
+
+static int *_fuzzy_row(SymFuzzy *f, size_t depth)
+{
+	if(depth >= f->RowCount)
+	{
+		f->RowCount = 2 * depth + 16;
+		f->Rows = realloc(f->Rows,
+			f->RowCount * (f->Length + 1) * sizeof(*f->Rows));
+	}
+
+	return f->Rows + depth * (f->Length + 1);
+}
+
+/* Computes the row for `c` from the row before it,
+	returns the smallest distance in the new row */
+static int _fuzzy_step(SymFuzzy *f, size_t depth, char c)
+{
+	int j;
+	int *row = _fuzzy_row(f, depth);
+	int *prev = row - (f->Length + 1);
+	int min = row[0] = prev[0] + 1;
+	for(j = 1; j <= f->Length; ++j)
+	{
+		int d = prev[j - 1] + (f->Query[j - 1] != c);
+		if(prev[j] + 1 < d)
+		{
+			d = prev[j] + 1;
+		}
+
+		if(row[j - 1] + 1 < d)
+		{
+			d = row[j - 1] + 1;
+		}
+
+		row[j] = d;
+		if(d < min)
+		{
+			min = d;
+		}
+	}
+
+	return min;
+}
+
+static void _fuzzy(SymFuzzy *f, const SymNode *entry, size_t len)
+{
+	while(entry && f->Results != f->MaxResults)
+	{
+		const char *edge = entry->Label;
+		size_t depth = len;
+		int min = 0;
+		while(*edge && min <= f->MaxEdits)
+		{
+			_key_reserve(&f->Key, depth + 2);
+			f->Key.Buffer[depth] = *edge;
+			min = _fuzzy_step(f, ++depth, *edge++);
+		}
+
+		/* No key below this node can be within the edit distance */
+		if(min <= f->MaxEdits)
+		{
+			int distance = _fuzzy_row(f, depth)[f->Length];
+			f->Key.Buffer[depth] = '\0';
+			if(_is_leaf(entry) && distance <= f->MaxEdits)
+			{
+				f->Callback(f->Data, f->Key.Buffer, entry->Value, distance);
+				++f->Results;
+			}
+
+			_fuzzy(f, entry->Children, depth);
+		}
+
+		entry = entry->Next;
+	}
+}
+
+/* Hash of a key, folded with `fold` if it is set */
+static uint64_t _hash(const char *ident, const unsigned char *fold)
+{
+	uint64_t h = 14695981039346656037u;
+	while(*ident)
+	{
+		unsigned char c = *ident++;
+		h ^= fold ? fold[c] : c;
+		h *= 1099511628211u;
+	}
+
+	/* FNV-1a mixes the last bytes poorly into the high bits */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdu;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline SymHotSlot *_hot_set(const SymHot *hot, uint64_t h)
+{
+	return (SymHotSlot *)hot->Sets[h & (HOT_SETS - 1)];
+}
+
+/* Compares a cached key, which is folded, with a key that may not be */
+static inline int _hot_equal(const char *key, const char *ident,
+	const unsigned char *fold)
+{
+	size_t n;
+	if(!fold)
+	{
+		return !strcmp(key, ident);
+	}
+
+	n = _common(key, ident, fold);
+	return !key[n] && !ident[n];
+}
+
+/* Slot of the key `ident` (as stored in the tree) or NULL */
+static SymHotSlot *_hot_find(const SymHot *hot, uint64_t h,
+	const char *ident, const unsigned char *fold)
+{
+	SymHotSlot *set = _hot_set(hot, h);
+	uint32_t tag = h >> 32;
+	int i;
+	for(i = 0; i < 2; ++i)
+	{
+		if(set[i].Value && set[i].Tag == tag &&
+			_hot_equal(set[i].Key, ident, fold))
+		{
+			return &set[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Looks up a key, a hit becomes the most recently used slot of its set */
+static int _hot_get(SymHot *hot, uint64_t h, const char *ident,
+	const unsigned char *fold, int *value)
+{
+	SymHotSlot *set, *slot = _hot_find(hot, h, ident, fold);
+	SymHotSlot tmp;
+	if(!slot)
+	{
+		++hot->Misses;
+		return 0;
+	}
+
+	++hot->Hits;
+	*value = slot->Value;
+	set = _hot_set(hot, h);
+	if(slot != set)
+	{
+		tmp = set[0];
+		set[0] = set[1];
+		set[1] = tmp;
+	}
+
+	return 1;
+}
+
+/* Adds a symbol that was found in the tree in the least recently used
+	slot of its set. It only becomes the most recently used one with a hit,
+	so keys that are looked up once don't push out frequent ones. */
+static void _hot_add(SymHot *hot, uint64_t h, const char *ident,
+	const unsigned char *fold, int value)
+{
+	SymHotSlot *slot = _hot_set(hot, h) + 1;
+	size_t len = strlen(ident);
+	if(len >= HOT_KEY)
+	{
+		return;
+	}
+
+	slot->Tag = h >> 32;
+	slot->Value = value;
+	memcpy(slot->Key, ident, len + 1);
+	_fold(slot->Key, fold);
+}
+
+/* Removes a key from the cache, returns 1 if it was cached */
+static int _hot_drop(SymHot *hot, const char *key, const unsigned char *fold)
+{
+	SymHotSlot *slot;
+	if(!hot || !(slot = _hot_find(hot, _hash(key, fold), key, fold)))
+	{
+		return 0;
+	}
+
+	slot->Value = 0;
+	return 1;
+}
+
+static void _clock_victim(SymClock *c)
+{
+	c->Victims[c->Count++] = strdup(c->Key.Buffer);
+}
+
+/* Moves the CLOCK hand over the symbols below `entry` in tree order,
+	starting after the key `resume` if it is set. Referenced symbols get
+	a second chance, the others become victims. Returns 1 once enough
+	victims were found. */
+static int _clock_sweep(SymClock *c, SymNode *entry, size_t len,
+	const char *resume)
+{
+	if(resume)
+	{
+		SymNode *start = entry;
+		size_t label_len = 0;
+		while(entry)
+		{
+			label_len = strlen(entry->Label);
+			if(!strncmp(entry->Label, resume, label_len))
+			{
+				break;
+			}
+
+			entry = entry->Next;
+		}
+
+		if(!entry)
+		{
+			/* The path to the hand is gone, restart this level */
+			entry = start;
+		}
+		else
+		{
+			_key_reserve(&c->Key, len + label_len + 1);
+			memcpy(c->Key.Buffer + len, entry->Label, label_len + 1);
+			resume += label_len;
+			if(_clock_sweep(c, entry->Children, len + label_len,
+				*resume ? resume : NULL))
+			{
+				return 1;
+			}
+
+			entry = entry->Next;
+		}
+	}
+
+	while(entry)
+	{
+		size_t label_len = strlen(entry->Label);
+		_key_reserve(&c->Key, len + label_len + 1);
+		memcpy(c->Key.Buffer + len, entry->Label, label_len + 1);
+		if(_is_leaf(entry))
+		{
+			/* Lookups of cached symbols don't reach the tree to set the
+				reference bit, being cached counts as referenced instead */
+			if(entry->Flags & NODE_REFERENCED)
+			{
+				entry->Flags &= ~NODE_REFERENCED;
+			}
+			else if(!_hot_drop(c->Hot, c->Key.Buffer, c->Fold))
+			{
+				_clock_victim(c);
+				if(c->Count == c->Need)
+				{
+					return 1;
+				}
+			}
+		}
+
+		if(_clock_sweep(c, entry->Children, len + label_len, NULL))
+		{
+			return 1;
+		}
+
+		entry = entry->Next;
+	}
+
+	return 0;
+}
+
+static inline int _over_budget(const SymTab *tab)
+{
+	return (tab->MaxKeys && tab->Count > tab->MaxKeys) ||
+		(tab->MaxBytes && tab->Bytes > tab->MaxBytes);
+}
+
+/* Evicts as many symbols as are needed to get back within the budget */
+static void _evict(SymTab *tab)
+{
+	SymClock c;
+	size_t i, need = 1;
+	int pass;
+
+	if(tab->MaxKeys && tab->Count > tab->MaxKeys)
+	{
+		need = tab->Count - tab->MaxKeys;
+	}
+
+	if(tab->MaxBytes && tab->Bytes > tab->MaxBytes)
+	{
+		size_t bytes_per_key = tab->Bytes / tab->Count + 1;
+		size_t n = (tab->Bytes - tab->MaxBytes) / bytes_per_key + 1;
+		if(n > need)
+		{
+			need = n;
+		}
+	}
+
+	c.Key.Buffer = NULL;
+	c.Key.Capacity = 0;
+	c.Victims = malloc(need * sizeof(*c.Victims));
+	c.Count = 0;
+	c.Need = need;
+	c.Hot = tab->Hot;
+	c.Fold = tab->Fold;
+
+	/* After one full pass all reference bits are cleared */
+	for(pass = 0; pass < 3; ++pass)
+	{
+		if(_clock_sweep(&c, tab->Root->Children, 0,
+			pass ? NULL : tab->Hand))
+		{
+			break;
+		}
+	}
+
+	if(c.Count)
+	{
+		free(tab->Hand);
+		tab->Hand = strdup(c.Victims[c.Count - 1]);
+	}
+
+	for(i = 0; i < c.Count; ++i)
+	{
+		/* symtab_remove takes the key as the user sees it */
+		char *victim = tab->Dict ? _dict_text(tab->Dict, c.Victims[i]) :
+			c.Victims[i];
+
+		if(symtab_remove(tab, victim))
+		{
+			++tab->Evictions;
+		}
+
+		if(victim != c.Victims[i])
+		{
+			free(victim);
+		}
+
+		free(c.Victims[i]);
+	}
+
+	free(c.Victims);
+	free(c.Key.Buffer);
+}
+
+static size_t _alloc_size(const SymNode *entry)
+{
+	if(entry->Flags & NODE_ARENA)
+	{
+		return _frozen_size(entry);
+	}
+
+#ifdef __GLIBC__
+	return malloc_usable_size((void *)entry) + sizeof(size_t);
+#else
+	/* Typical allocator: one header word, 16 byte alignment */
+	return (_node_size(entry) + sizeof(size_t) + 15) & ~(size_t)15;
+#endif /* __GLIBC__ */
+}
+
+static void _stats_add(size_t *histogram, size_t bucket)
+{
+	histogram[bucket < SYMTAB_HISTOGRAM ? bucket : SYMTAB_HISTOGRAM - 1]++;
+}
+
+static int _log2(size_t n)
+{
+	int i = 0;
+	while(n >>= 1)
+	{
+		++i;
+	}
+
+	return i;
+}
+
+static void _stats_node(SymStats *out, const SymNode *entry, size_t depth,
+	int frozen)
+{
+	++out->Nodes;
+	out->LabelBytes += strlen(entry->Label);
+	out->NodeBytes += _node_size(entry);
+	out->AllocatorBytes += frozen ? 0 : _alloc_size(entry);
+	if(_is_leaf(entry))
+	{
+		++out->Leaves;
+		_stats_add(out->Depth, depth);
+	}
+}
+
+static void _stats_list(SymStats *out, const SymNode *entry)
+{
+	size_t siblings = 0;
+	while(entry)
+	{
+		++siblings;
+		entry = entry->Next;
+	}
+
+	_stats_add(out->Siblings, _log2(siblings));
+}
+
+/* Adds all nodes of the sibling list `entry` at `depth` and below */
+static void _stats(SymStats *out, const SymNode *entry, size_t depth,
+	int frozen)
+{
+	SymIter it;
+	SymIterFrame frame;
+	_iter_init(&it, entry);
+	while((entry = _iter_next(&it, &frame)))
+	{
+		_stats_node(out, entry, depth + frame.Depth - 1, frozen);
+		if(frame.First)
+		{
+			_stats_list(out, entry);
+		}
+	}
+
+	_iter_free(&it);
+}
+
+static void _stats_merge(SymStats *out, const SymStats *add)
+{
+	int i;
+	out->Nodes += add->Nodes;
+	out->Leaves += add->Leaves;
+	out->LabelBytes += add->LabelBytes;
+	out->NodeBytes += add->NodeBytes;
+	out->AllocatorBytes += add->AllocatorBytes;
+	for(i = 0; i < SYMTAB_HISTOGRAM; ++i)
+	{
+		out->Depth[i] += add->Depth[i];
+		out->Siblings[i] += add->Siblings[i];
+	}
+}
+
+static double _average(unsigned long visits, unsigned long ops)
+{
+	return ops ? (double)visits / ops : 0.0;
+}
+
+static void _stats_begin(const SymTab *tab, SymStats *out)
+{
+	memset(out, 0, sizeof(*out));
+	out->Nodes = 1;
+	out->NodeBytes = _node_size(tab->Root);
+	out->AllocatorBytes = tab->Frozen ? 0 : _alloc_size(tab->Root);
+}
+
+static void _stats_end(const SymTab *tab, SymStats *out)
+{
+	/* A frozen table has no allocator overhead, only node alignment */
+	out->AllocatorBytes = tab->Frozen ? tab->Bytes - out->NodeBytes :
+		out->AllocatorBytes - out->NodeBytes;
+
+	out->Gets = tab->Ops[OP_GET];
+	out->Puts = tab->Ops[OP_PUT];
+	out->Removes = tab->Ops[OP_REMOVE];
+	out->GetVisits = _average(tab->Visits[OP_GET], tab->Ops[OP_GET]);
+	out->PutVisits = _average(tab->Visits[OP_PUT], tab->Ops[OP_PUT]);
+	out->RemoveVisits =
+		_average(tab->Visits[OP_REMOVE], tab->Ops[OP_REMOVE]);
+}
+
+static inline uint64_t *_bloom_block(const SymBloom *bloom, uint64_t h)
+{
+	return bloom->Blocks + ((h >> 32) & bloom->Mask) * (BLOOM_BLOCK_BITS / 64);
+}
+
+static void _bloom_add(SymBloom *bloom, uint64_t h)
+{
+	int i;
+	uint64_t *block = _bloom_block(bloom, h);
+	uint32_t h1 = h, h2 = (h >> 32) | 1;
+	for(i = 0; i < BLOOM_HASHES; ++i)
+	{
+		uint32_t bit = (h1 + i * h2) % BLOOM_BLOCK_BITS;
+		block[bit / 64] |= (uint64_t)1 << (bit % 64);
+	}
+}
+
+static int _bloom_test(const SymBloom *bloom, uint64_t h)
+{
+	int i;
+	const uint64_t *block = _bloom_block(bloom, h);
+	uint32_t h1 = h, h2 = (h >> 32) | 1;
+	for(i = 0; i < BLOOM_HASHES; ++i)
+	{
+		uint32_t bit = (h1 + i * h2) % BLOOM_BLOCK_BITS;
+		if(!(block[bit / 64] & ((uint64_t)1 << (bit % 64))))
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int _bloom_put(void *data, const char *ident, int value)
+{
+	_bloom_add(data, _hash(ident, NULL));
+	return 0;
+	(void)value;
+}
+
+/* Sizes the filter for twice the current number of symbols and refills it */
+static void _bloom_rebuild(SymTab *tab)
+{
+	SymBloom *bloom = tab->Bloom;
+	size_t blocks = 1;
+	size_t bits;
+
+	bloom->Planned = 2 * tab->Count;
+	if(bloom->Planned < 64)
+	{
+		bloom->Planned = 64;
+	}
+
+	bits = bloom->Planned * BLOOM_BITS_PER_KEY;
+	while(blocks * BLOOM_BLOCK_BITS < bits)
+	{
+		blocks *= 2;
+	}
+
+	free(bloom->Blocks);
+	bloom->Blocks = aligned_alloc(64, blocks * (BLOOM_BLOCK_BITS / 8));
+	memset(bloom->Blocks, 0, blocks * (BLOOM_BLOCK_BITS / 8));
+	bloom->Mask = blocks - 1;
+	bloom->Removed = 0;
+	bloom->Stale = 0;
+	_walk(tab->Root->Children, NULL, bloom, _bloom_put);
+}
+
+static inline uint32_t _hash_bucket(uint64_t h, uint32_t buckets)
+{
+	return ((h >> 32) * buckets) >> 32;
+}
+
+static inline uint32_t _hash_slot(uint64_t h, uint32_t seed, uint32_t size)
+{
+	h ^= seed * 0x9e3779b97f4a7c15u;
+	h ^= h >> 31;
+	h *= 0xbf58476d1ce4e5b9u;
+	h ^= h >> 29;
+	return ((h & 0xffffffff) * size) >> 32;
+}
+
+static const SymHashSlot *_hash_find(const SymHash *hash, const char *ident,
+	const unsigned char *fold)
+{
+	uint64_t h = _hash(ident, fold);
+	const SymHashSlot *slot = hash->Slots +
+		_hash_slot(h, hash->Seeds[_hash_bucket(h, hash->Buckets)], hash->Size);
+
+	size_t n = _common(slot->Key, ident, fold);
+	return slot->Key[n] || ident[n] ? NULL : slot;
+}
+
+static int _hash_cmp(const void *a, const void *b)
+{
+	const uint32_t *x = a, *y = b;
+	if(x[0] != y[0])
+	{
+		return x[0] < y[0] ? 1 : -1;
+	}
+
+	return x[1] < y[1] ? -1 : x[1] > y[1];
+}
+
+/* Finds a seed that moves all symbols of a bucket to free slots */
+static int _hash_place(SymHash *hash, uint8_t *taken,
+	const SymHashKey *keys, uint32_t count, uint32_t bucket)
+{
+	uint32_t seed, i, slot;
+	for(seed = 0; seed < HASH_MAX_SEED; ++seed)
+	{
+		for(i = 0; i < count; ++i)
+		{
+			slot = _hash_slot(keys[i].Hash, seed, hash->Size);
+			if(taken[slot])
+			{
+				break;
+			}
+
+			taken[slot] = 1;
+		}
+
+		if(i == count)
+		{
+			SymHashSlot *slots = (SymHashSlot *)hash->Slots;
+			((uint32_t *)hash->Seeds)[bucket] = seed;
+			for(i = 0; i < count; ++i)
+			{
+				slot = _hash_slot(keys[i].Hash, seed, hash->Size);
+				slots[slot].Key = keys[i].Key;
+				slots[slot].Value = keys[i].Value;
+			}
+
+			return 0;
+		}
+
+		while(i--)
+		{
+			taken[_hash_slot(keys[i].Hash, seed, hash->Size)] = 0;
+		}
+	}
+
+	return -1;
+}
+
+/* Builds the perfect hash index of a frozen table with the keys in the same
+	allocation. Buckets are placed largest first, while most slots are free.
+	Returns NULL if a bucket can't be placed (like keys with equal hashes),
+	then lookups go through the tree. */
+static SymHash *_hash_build(const SymTab *tab, size_t *mapped)
+{
+	SymIter it;
+	SymIterFrame frame;
+	const SymNode *entry;
+	SymHash *hash;
+	SymHashKey *keys, *sorted;
+	uint32_t *order, *start, n = 0, buckets, i;
+	size_t key_bytes = 0;
+	uint8_t *taken;
+	char *p;
+	int ok = 1;
+
+	_iter_init(&it, tab->Root->Children);
+	while((entry = _iter_next(&it, &frame)))
+	{
+		if(_is_leaf(entry))
+		{
+			++n;
+			key_bytes += frame.Length + strlen(entry->Label) + 1;
+		}
+	}
+
+	_iter_free(&it);
+	if(!n)
+	{
+		return NULL;
+	}
+
+	buckets = n / HASH_BUCKET_KEYS + 1;
+	hash = _block_alloc(tab->Huge, sizeof(*hash) + n * sizeof(SymHashSlot) +
+		buckets * sizeof(uint32_t) + key_bytes, mapped);
+	hash->Slots = (SymHashSlot *)(hash + 1);
+	hash->Seeds = (uint32_t *)(hash->Slots + n);
+	hash->Buckets = buckets;
+	hash->Size = n;
+	p = (char *)(hash->Seeds + buckets);
+
+	keys = malloc(n * sizeof(*keys));
+	n = 0;
+	_iter_init(&it, tab->Root->Children);
+	while((entry = _iter_next(&it, &frame)))
+	{
+		if(_is_leaf(entry))
+		{
+			size_t len = frame.Length + strlen(entry->Label) + 1;
+			memcpy(p, it.Key.Buffer, len);
+			keys[n].Hash = _hash(p, NULL);
+			keys[n].Bucket = _hash_bucket(keys[n].Hash, buckets);
+			keys[n].Key = p;
+			keys[n].Value = entry->Value;
+			p += len;
+			++n;
+		}
+	}
+
+	_iter_free(&it);
+
+	/* Group the keys by bucket, then order the buckets by size */
+	start = calloc(buckets + 1, sizeof(*start));
+	order = malloc(2 * buckets * sizeof(*order));
+	sorted = malloc(n * sizeof(*sorted));
+	for(i = 0; i < n; ++i)
+	{
+		++start[keys[i].Bucket + 1];
+	}
+
+	for(i = 0; i < buckets; ++i)
+	{
+		order[2 * i] = start[i + 1];
+		order[2 * i + 1] = i;
+		start[i + 1] += start[i];
+	}
+
+	for(i = 0; i < n; ++i)
+	{
+		sorted[start[keys[i].Bucket]++] = keys[i];
+	}
+
+	qsort(order, buckets, 2 * sizeof(*order), _hash_cmp);
+	taken = calloc(n, 1);
+	memset((uint32_t *)hash->Seeds, 0, buckets * sizeof(uint32_t));
+	for(i = 0; ok && i < buckets && order[2 * i]; ++i)
+	{
+		uint32_t count = order[2 * i], bucket = order[2 * i + 1];
+		ok = !_hash_place(hash, taken,
+			sorted + start[bucket] - count, count, bucket);
+	}
+
+	free(taken);
+	free(sorted);
+	free(order);
+	free(start);
+	free(keys);
+	if(!ok)
+	{
+		_block_free(hash, *mapped);
+		*mapped = 0;
+		return NULL;
+	}
+
+	return hash;
+}
+
+static void _tasks_free(SymTasks *t)
+{
+	free(t->Tasks);
+	free(t->Keys.Buffer);
+}
+
+/* Stores the key above new tasks, `key` followed by `label` */
+static size_t _tasks_key(SymTasks *t, const char *key, size_t len,
+	const char *label)
+{
+	size_t offset = t->KeysLength;
+	size_t label_len = strlen(label);
+	_key_reserve(&t->Keys, offset + len + label_len + 1);
+	memcpy(t->Keys.Buffer + offset, key, len);
+	memcpy(t->Keys.Buffer + offset + len, label, label_len);
+	t->KeysLength += len + label_len;
+	return offset;
+}
+
+static void _tasks_add(SymTasks *t, SymNode *entry, size_t key, size_t len,
+	size_t depth)
+{
+	SymTask *task;
+	if(t->Count == t->Capacity)
+	{
+		t->Capacity = t->Capacity ? 2 * t->Capacity : 64;
+		t->Tasks = realloc(t->Tasks, t->Capacity * sizeof(*t->Tasks));
+	}
+
+	task = t->Tasks + t->Count++;
+	task->Node = entry;
+	task->Key = key;
+	task->Length = len;
+	task->Depth = depth;
+}
+
+/* Splits the sibling list `entry` into tasks of single subtrees, one level
+	at a time until there are `want` tasks or only leaves are left. Nodes of
+	split levels are passed to `expand` after their children became tasks. */
+static void _tasks_split(SymTasks *t, SymNode *entry, const char *key,
+	size_t len, size_t depth, size_t want, void *data,
+	void (*expand)(void *data, const SymTasks *t, const SymTask *task))
+{
+	SymTasks next;
+	size_t i, offset;
+
+	memset(t, 0, sizeof(*t));
+	offset = _tasks_key(t, key, len, "");
+	for(; entry; entry = entry->Next)
+	{
+		_tasks_add(t, entry, offset, len, depth);
+	}
+
+	while(t->Count < want)
+	{
+		for(i = 0; i < t->Count && !t->Tasks[i].Node->Children; ++i) {}
+		if(i == t->Count)
+		{
+			break;
+		}
+
+		memset(&next, 0, sizeof(next));
+		for(i = 0; i < t->Count; ++i)
+		{
+			SymTask *task = t->Tasks + i;
+			SymNode *child = task->Node->Children;
+			offset = _tasks_key(&next, t->Keys.Buffer + task->Key,
+				task->Length, child ? task->Node->Label : "");
+
+			if(!child)
+			{
+				_tasks_add(&next, task->Node, offset, task->Length,
+					task->Depth);
+				continue;
+			}
+
+			for(; child; child = child->Next)
+			{
+				_tasks_add(&next, child, offset,
+					task->Length + strlen(task->Node->Label), task->Depth + 1);
+			}
+
+			expand(data, t, task);
+		}
+
+		_tasks_free(t);
+		*t = next;
+	}
+}
+
+/* Split levels are handled before the pool starts, with worker 0's state */
+static void _stats_expand(void *data, const SymTasks *t, const SymTask *task)
+{
+	SymParallel *p = data;
+	_stats_node(&p->Stats[0], task->Node, task->Depth, p->Tab->Frozen);
+	_stats_list(&p->Stats[0], task->Node->Children);
+	(void)t;
+}
+
+static void _stats_task(void *data, size_t item, int worker)
+{
+	SymParallel *p = data;
+	const SymTask *task = p->Tasks->Tasks + item;
+	_stats_node(&p->Stats[worker], task->Node, task->Depth, p->Tab->Frozen);
+	_stats(&p->Stats[worker], task->Node->Children, task->Depth + 1,
+		p->Tab->Frozen);
+}
+
+/* Finds the first node whose key starts with `prefix`, all symbols with
+	the prefix are in its subtree. `len` receives the length of the key above
+	the node. Returns the root for an empty prefix. */
+static const SymNode *_prefix_find(const SymNode *entry, const char *prefix,
+	const unsigned char *fold, size_t *len)
+{
+	*len = 0;
+	while(entry)
+	{
+		size_t n = _common(entry->Label, prefix, fold);
+		const char *search = prefix + n;
+		const char *edge = entry->Label + n;
+
+		if(!*search && (search > prefix || !*entry->Label))
+		{
+			return entry;
+		}
+		else if(!*edge)
+		{
+			*len += edge - entry->Label;
+			prefix = search;
+			entry = entry->Children;
+		}
+		else if(edge == entry->Label)
+		{
+			entry = entry->Next;
+		}
+		else
+		{
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+
+static void _prefix_report(SymParallel *p, int worker, const SymNode *entry,
+	const char *key, size_t len)
+{
+	SymKey *buf = &p->Keys[worker];
+	size_t label_len = strlen(entry->Label);
+	if(_is_leaf(entry))
+	{
+		_key_reserve(buf, len + label_len + 1);
+		memcpy(buf->Buffer, key, len);
+		memcpy(buf->Buffer + len, entry->Label, label_len + 1);
+		p->Callback(p->Data, worker, buf->Buffer, entry->Value);
+		++p->Results[worker];
+	}
+}
+
+static void _prefix_expand(void *data, const SymTasks *t, const SymTask *task)
+{
+	_prefix_report(data, 0, task->Node, t->Keys.Buffer + task->Key,
+		task->Length);
+}
+
+static void _prefix_task(void *data, size_t item, int worker)
+{
+	SymParallel *p = data;
+	const SymTask *task = p->Tasks->Tasks + item;
+	const SymNode *entry = task->Node;
+	SymKey *buf = &p->Keys[worker];
+	size_t len = task->Length + strlen(entry->Label);
+	SymIter it;
+	SymIterFrame frame;
+
+	_prefix_report(p, worker, entry, p->Tasks->Keys.Buffer + task->Key,
+		task->Length);
+
+	_key_reserve(buf, len + 1);
+	memcpy(buf->Buffer, p->Tasks->Keys.Buffer + task->Key, task->Length);
+	strcpy(buf->Buffer + task->Length, entry->Label);
+	_iter_init(&it, entry->Children);
+	while((entry = _iter_next(&it, &frame)))
+	{
+		if(_is_leaf(entry))
+		{
+			size_t n = frame.Length + strlen(entry->Label) + 1;
+			_key_reserve(buf, len + n);
+			memcpy(buf->Buffer + len, it.Key.Buffer, n);
+			p->Callback(p->Data, worker, buf->Buffer, entry->Value);
+			++p->Results[worker];
+		}
+	}
+
+	_iter_free(&it);
+}
+
+/* Nodes are freed into a per-worker table, so that the byte counters
+	aren't shared between threads */
+static void _destroy_expand(void *data, const SymTasks *t, const SymTask *task)
+{
+	SymParallel *p = data;
+	_node_free(&p->Sinks[0], task->Node);
+	(void)t;
+}
+
+static void _destroy_task(void *data, size_t item, int worker)
+{
+	SymParallel *p = data;
+	SymNode *entry = p->Tasks->Tasks[item].Node;
+	entry->Next = NULL;
+	_node_release_step(&p->Sinks[worker], entry, (size_t)-1);
+}
+
+/* Inserts the symbols starting with one byte into the worker's table */
+static void _build_task(void *data, size_t item, int worker)
+{
+	SymParallel *p = data;
+	size_t i;
+	for(i = p->Start[item + 1]; i < p->Start[item + 2]; ++i)
+	{
+		symtab_put(p->Tabs[worker], p->Idents[p->Order[i]],
+			p->Values[p->Order[i]]);
+	}
+}
+
+/* Counts all substrings of 2 to DICT_MAX bytes of the samples */
+static void _dict_count(SymWord *words, const char *const *samples,
+	size_t count)
+{
+	size_t i, len, used = 0;
+	for(i = 0; i < count; ++i)
+	{
+		const char *p;
+		for(p = samples[i]; *p; ++p)
+		{
+			uint32_t h = 2166136261u;
+			for(len = 1; len <= DICT_MAX && p[len - 1]; ++len)
+			{
+				SymWord *w;
+				h = (h ^ (unsigned char)p[len - 1]) * 16777619u;
+				if(len < 2)
+				{
+					continue;
+				}
+
+				w = words + (h & (DICT_TABLE - 1));
+				while(w->Count && (w->Length != len ||
+					memcmp(w->Start, p, len)))
+				{
+					w = w + 1 < words + DICT_TABLE ? w + 1 : words;
+				}
+
+				/* New substrings are ignored once the table is half full */
+				if(!w->Count)
+				{
+					if(2 * used >= DICT_TABLE)
+					{
+						continue;
+					}
+
+					w->Start = p;
+					w->Length = len;
+					++used;
+				}
+
+				++w->Count;
+			}
+		}
+	}
+}
+
+/* Calls `callback` with the decoded key of every symbol of a compressed
+	table that starts with `prefix`, until it returns 1. Encoding doesn't
+	preserve prefixes, so the labels are decoded on the way down and
+	subtrees are skipped as soon as their key diverges from the prefix. */
+static void _dict_prefix(const SymTab *tab, const char *prefix,
+	SymDictPrefix *dp, int (*callback)(SymDictPrefix *dp, const char *ident,
+	size_t len))
+{
+	SymIter it;
+	SymIterFrame frame;
+	const SymNode *entry;
+	size_t prefix_len = strlen(prefix);
+	_iter_init(&it, tab->Root->Children);
+	it.Dict = tab->Dict;
+	while((entry = _iter_next(&it, &frame)))
+	{
+		const char *label = it.Key.Buffer + frame.Length;
+		size_t len = frame.Length + strlen(label);
+		size_t n = len < prefix_len ? len : prefix_len;
+		if(n > frame.Length &&
+			memcmp(label, prefix + frame.Length, n - frame.Length))
+		{
+			_iter_skip(&it);
+		}
+		else if(len >= prefix_len && _is_leaf(entry) &&
+			callback(dp, it.Key.Buffer, len))
+		{
+			break;
+		}
+	}
+
+	_iter_free(&it);
+}
+
+/* Shortens the common prefix, stops when it's only the query itself */
+static int _dict_complete(SymDictPrefix *dp, const char *ident, size_t len)
+{
+	size_t i = 0;
+	if(!dp->Results++)
+	{
+		_key_reserve(&dp->Common, len + 1);
+		memcpy(dp->Common.Buffer, ident, len + 1);
+		dp->Length = len;
+		return 0;
+	}
+
+	while(i < dp->Length && i < len && dp->Common.Buffer[i] == ident[i])
+	{
+		++i;
+	}
+
+	dp->Length = i;
+	return dp->Length == strlen(dp->Ident);
+}
+
+static int _dict_iter(SymDictPrefix *dp, const char *ident, size_t len)
+{
+	memcpy(dp->Ident, ident, len + 1);
+	dp->Callback(dp->Data, dp->Ident);
+	return ++dp->Results == dp->MaxResults;
+}
+
+static int _dict_contains(const SymWord *outer, const SymWord *inner)
+{
+	size_t i;
+	for(i = 0; i + inner->Length <= outer->Length; ++i)
+	{
+		if(!memcmp(outer->Start + i, inner->Start, inner->Length))
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Picks the words that save the most bytes. The occurrences of a word
+	inside a picked word are used up, so the many substrings of a frequent
+	long word don't fill the dictionary. */
+static void _dict_train(SymDict *dict, const char *const *samples,
+	size_t count)
+{
+	SymWord *words = calloc(DICT_TABLE, sizeof(*words));
+	size_t i, j, n = 0;
+	int k;
+
+	_dict_count(words, samples, count < DICT_SAMPLES ? count : DICT_SAMPLES);
+	for(i = 0; i < DICT_TABLE; ++i)
+	{
+		if(words[i].Count > 1)
+		{
+			words[n++] = words[i];
+		}
+	}
+
+	memset(dict, 0, sizeof(*dict));
+	for(k = 0; k < DICT_WORDS; ++k)
+	{
+		SymWord *best = NULL;
+		unsigned char *link;
+		for(i = 0; i < n; ++i)
+		{
+			if(words[i].Count > 1 && (!best || words[i].Count *
+				(words[i].Length - 1) > best->Count * (best->Length - 1)))
+			{
+				best = words + i;
+			}
+		}
+
+		if(!best)
+		{
+			break;
+		}
+
+		for(j = 0; j < n; ++j)
+		{
+			if(words + j != best && words[j].Length < best->Length &&
+				_dict_contains(best, words + j))
+			{
+				words[j].Count -= words[j].Count < best->Count ?
+					words[j].Count : best->Count;
+			}
+		}
+
+		memcpy(dict->Words[k], best->Start, best->Length);
+		dict->Length[k] = best->Length;
+		best->Count = 0;
+
+		/* Insert into the list of its first byte, longest word first */
+		link = &dict->First[(unsigned char)dict->Words[k][0]];
+		while(*link && dict->Length[*link - 1] >= dict->Length[k])
+		{
+			link = &dict->Next[*link - 1];
+		}
+
+		dict->Next[k] = *link;
+		*link = k + 1;
+	}
+
+	free(words);
+}
+
+/* Copies the node `*link` into the arena, unless that was done already
+	in this pass or it is too large, and returns it */
+static SymNode *_compact_node(SymTab *tab, SymNode **link)
+{
+	SymNode *entry = *link, *copy;
+	if((entry->Flags & NODE_ARENA) && _arena_of(entry)->Pass == tab->Pass)
+	{
+		return entry;
+	}
+
+	if(!(copy = _arena_alloc(tab, entry)))
+	{
+		return entry;
+	}
+
+	memcpy(copy, entry, _node_size(entry));
+	copy->Flags = (copy->Flags & NODE_REFERENCED) | NODE_ARENA |
+		(tab->Arena->Size == HUGE_PAGE ? NODE_HUGE : 0);
+	*link = copy;
+	_node_dispose(entry);
+	return copy;
+}
+
+static void _compact_push(SymCompact *c, SymNode **link, size_t len)
+{
+	if(!*link)
+	{
+		return;
+	}
+
+	if(c->Top == c->Capacity)
+	{
+		c->Capacity = c->Capacity ? 2 * c->Capacity : 64;
+		c->Stack = realloc(c->Stack, c->Capacity * sizeof(*c->Stack));
+	}
+
+	c->Stack[c->Top].Link = link;
+	c->Stack[c->Top++].Length = len;
+}
+
+/* Appends the label of `entry` to the key at `len` */
+static size_t _compact_key(SymCompact *c, const SymNode *entry, size_t len)
+{
+	size_t label_len = strlen(entry->Label);
+	_key_reserve(&c->Key, len + label_len + 1);
+	memcpy(c->Key.Buffer + len, entry->Label, label_len + 1);
+	return len + label_len;
+}
+
+/* Continues a pass after the node with the key `tab->Compact`: pending are
+	the next siblings of all nodes on the path and the node's children.
+	The tree may have changed in between, so the nodes on the path are
+	copied again if needed. If the path is gone, the level where it ends
+	is done again. */
+static void _compact_resume(SymTab *tab, SymCompact *c)
+{
+	const char *resume = tab->Compact;
+	SymNode **link = &tab->Root;
+	size_t len = 0, end;
+	SymNode *entry;
+
+	for(;;)
+	{
+		/* Nothing below a shared node can be moved */
+		if(_is_shared(*link))
+		{
+			return;
+		}
+
+		entry = _compact_node(tab, link);
+		end = _compact_key(c, entry, len);
+		_compact_push(c, &entry->Next, len);
+		len = end;
+		if(!resume[len])
+		{
+			break;
+		}
+
+		link = &entry->Children;
+		while(*link && strncmp((*link)->Label, resume + len,
+			strlen((*link)->Label)))
+		{
+			link = &(*link)->Next;
+		}
+
+		if(!*link)
+		{
+			break;
+		}
+	}
+
+	_compact_push(c, &entry->Children, len);
+}
+
+static unsigned char *_fold_copy(const unsigned char *fold)
+{
+	unsigned char *copy = NULL;
+	if(fold)
+	{
+		copy = malloc(256);
+		memcpy(copy, fold, 256);
+	}
+
+	return copy;
+}
+
+static void _destroy_begin(SymTab *tab)
+{
+	if(tab->Wal)
+	{
+		wal_close(tab->Wal);
+		tab->Wal = NULL;
+	}
+
+	if(tab->Bloom)
+	{
+		free(tab->Bloom->Blocks);
+		free(tab->Bloom);
+		tab->Bloom = NULL;
+	}
+
+	free(tab->Hot);
+	tab->Hot = NULL;
+
+	if(tab->Arena)
+	{
+		_arena_unref(tab->Arena);
+		tab->Arena = NULL;
+	}
+
+	free(tab->Compact);
+	tab->Compact = NULL;
+}
+
+static void _replay_apply(void *data, const char *ident, int value)
+{
+	SymTab *tab = data;
+	if(value)
+	{
+		symtab_put(tab, ident, value);
+	}
+	else
+	{
+		symtab_remove(tab, ident);
+	}
+}
+
+static int _clear_collect(void *data, const char *ident, int value)
+{
+	char ***next = data;
+	*(*next)++ = strdup(ident);
+	return 0;
+	(void)value;
+}
+
+/* Removes all symbols, so that a failed replay leaves no partial table */
+static void _clear(SymTab *tab)
+{
+	char **keys = malloc(tab->Count * sizeof(*keys) + 1);
+	char **next = keys;
+	_walk(tab->Root->Children, tab->Dict, &next, _clear_collect);
+	while(next > keys)
+	{
+		symtab_remove(tab, *--next);
+		free(*next);
+	}
+
+	free(keys);
+}
+
+static int _checkpoint_put(void *data, const char *ident, int value)
+{
+	return wal_image_put(data, ident, value);
+}
+
+/* Lookup of a key as stored in the tree */
+static int _get(const SymTab *tab, const char *ident)
+{
+	/* Statistics and reference bits are not part of the logical state */
+	SymTab *counters = (SymTab *)tab;
+	const SymNode *entry;
+	unsigned long visits = 0;
+	uint64_t h = 0;
+	int value;
+
+	/* Frozen tables are read from many threads at once, they don't count
+		operations so that the readers don't write to a shared cache line */
+	if(tab->Frozen)
+	{
+		const SymHashSlot *slot;
+		if(!tab->Hash)
+		{
+			entry = _find(tab->Root, ident, tab->Fold, &visits);
+			return entry ? entry->Value : 0;
+		}
+
+		slot = _hash_find(tab->Hash, ident, tab->Fold);
+		return slot ? slot->Value : 0;
+	}
+
+	STAT(++counters->Ops[OP_GET]);
+	if(tab->Bloom && tab->Bloom->Stale)
+	{
+		_bloom_rebuild(counters);
+	}
+
+	if(tab->Bloom || tab->Hot)
+	{
+		h = _hash(ident, tab->Fold);
+	}
+
+	if(tab->Hot && _hot_get(tab->Hot, h, ident, tab->Fold, &value))
+	{
+		counters->Hits += tab->MaxKeys || tab->MaxBytes;
+		return value;
+	}
+
+	if(tab->Bloom && !_bloom_test(tab->Bloom, h))
+	{
+		entry = NULL;
+	}
+	else
+	{
+		entry = _find(tab->Root, ident, tab->Fold, &counters->Visits[OP_GET]);
+	}
+
+	if(entry && tab->Hot)
+	{
+		_hot_add(tab->Hot, h, ident, tab->Fold, entry->Value);
+	}
+
+	if(!tab->MaxKeys && !tab->MaxBytes)
+	{
+		return entry ? entry->Value : 0;
+	}
+
+	if(!entry)
+	{
+		++counters->Misses;
+		return 0;
+	}
+
+	++counters->Hits;
+	if(!(entry->Flags & NODE_REFERENCED))
+	{
+		((SymNode *)entry)->Flags |= NODE_REFERENCED;
+	}
+
+	return entry->Value;
+}
+
+/* --- PUBLIC --- */
+SymTab *symtab_create(int capacity)
+{
+	SymTab *tab = calloc(1, sizeof(*tab));
+	SymNode *root = _entry_new(tab, 1);
+	root->Label[0] = '\0';
+	root->Value = 42;
+	tab->Root = root;
+	return tab;
+	(void)capacity;
+}
+
+SymTab *symtab_create_cache(size_t max_keys, size_t max_bytes)
+{
+	SymTab *tab = symtab_create(0);
+	tab->MaxKeys = max_keys;
+	tab->MaxBytes = max_bytes;
+	return tab;
+}
+
+void symtab_destroy(SymTab *tab)
+{
+	while(symtab_destroy_step(tab, (size_t)-1)) {}
+}
+
+int symtab_destroy_step(SymTab *tab, size_t budget)
+{
+	if(tab->Frozen)
+	{
+		/* Generated tables are static data */
+		if(tab->Block)
+		{
+			_block_free(tab->Block, tab->Mapped);
+			_block_free((void *)tab->Hash, tab->HashMapped);
+			free(tab->Dict);
+			free(tab->Fold);
+			free(tab);
+		}
+
+		return 0;
+	}
+
+	if(tab->Root)
+	{
+		/* First step: detach the tree, everything else is freed at once */
+		_destroy_begin(tab);
+		tab->Dying = _node_own(tab->Root);
+		tab->Root = NULL;
+	}
+
+	tab->Dying = _node_release_step(tab, tab->Dying, budget);
+	if(tab->Dying)
+	{
+		return 1;
+	}
+
+	free(tab->Hand);
+	free(tab->Dict);
+	free(tab->Fold);
+	free(tab);
+	return 0;
+}
+
+void symtab_destroy_parallel(SymTab *tab, int threads)
+{
+	SymParallel p;
+	SymTasks t;
+
+	/* Nodes shared with snapshots need the reference counting walk */
+	if(tab->Frozen || tab->Shared)
+	{
+		symtab_destroy(tab);
+		return;
+	}
+
+	threads = pool_threads(threads);
+	_destroy_begin(tab);
+	p.Sinks = calloc(threads, sizeof(*p.Sinks));
+	_tasks_split(&t, tab->Root->Children, "", 0, 1,
+		threads * PARALLEL_TASKS, &p, _destroy_expand);
+
+	p.Tasks = &t;
+	pool_run(t.Count, threads, &p, _destroy_task);
+	_tasks_free(&t);
+	free(p.Sinks);
+	_node_free(tab, tab->Root);
+	free(tab->Hand);
+	free(tab->Dict);
+	free(tab->Fold);
+	free(tab);
+}
+
+SymTab *symtab_build(const char *const *idents, const int *values,
+	size_t count, int threads)
+{
+	SymTab *tab = symtab_create(0);
+	SymNode **tail = &tab->Root->Children;
+	size_t start[258] = { 0 };
+	size_t *order = malloc(count * sizeof(*order));
+	SymParallel p;
+	size_t i;
+	int j, k;
+
+	/* Stable counting sort by the first byte, every byte is one task */
+	for(i = 0; i < count; ++i)
+	{
+		++start[(unsigned char)idents[i][0] + 2];
+	}
+
+	for(j = 2; j < 258; ++j)
+	{
+		start[j] += start[j - 1];
+	}
+
+	for(i = 0; i < count; ++i)
+	{
+		order[start[(unsigned char)idents[i][0] + 1]++] = i;
+	}
+
+	threads = pool_threads(threads);
+	p.Idents = idents;
+	p.Values = values;
+	p.Order = order;
+	p.Start = start;
+	p.Tabs = malloc(threads * sizeof(*p.Tabs));
+	for(j = 0; j < threads; ++j)
+	{
+		p.Tabs[j] = symtab_create(0);
+	}
+
+	pool_run(255, threads, &p, _build_task);
+
+	/* Symbols with different first bytes never share a node, so the
+		top-level lists of the workers are simply joined */
+	for(j = 0; j < threads; ++j)
+	{
+		SymTab *part = p.Tabs[j];
+		*tail = part->Root->Children;
+		while(*tail)
+		{
+			tail = &(*tail)->Next;
+		}
+
+		tab->Count += part->Count;
+		tab->Bytes += part->Bytes - _node_size(part->Root);
+		for(k = 0; k < OP_COUNT; ++k)
+		{
+			tab->Ops[k] += part->Ops[k];
+			tab->Visits[k] += part->Visits[k];
+		}
+
+		part->Root->Children = NULL;
+		symtab_destroy(part);
+	}
+
+	for(i = 0; i < start[1]; ++i)
+	{
+		symtab_put(tab, idents[order[i]], values[order[i]]);
+	}
+
+	free(p.Tabs);
+	free(order);
+	return tab;
+}
+
+int symtab_compact(SymTab *tab, size_t budget)
+{
+	SymCompact c;
+	SymCompactFrame f;
+	SymNode *entry;
+
+	if(tab->ReadOnly)
+	{
+		return 0;
+	}
+
+	c.Stack = NULL;
+	c.Top = 0;
+	c.Capacity = 0;
+	c.Key.Buffer = NULL;
+	c.Key.Capacity = 0;
+	_key_reserve(&c.Key, 1);
+	c.Key.Buffer[0] = '\0';
+	if(tab->Compact)
+	{
+		_compact_resume(tab, &c);
+	}
+	else
+	{
+		++tab->Pass;
+		_compact_push(&c, &tab->Root, 0);
+	}
+
+	for(; c.Top && budget; --budget)
+	{
+		f = c.Stack[--c.Top];
+		if(_is_shared(*f.Link))
+		{
+			continue;
+		}
+
+		/* Children before siblings: pre-order, like a frozen table */
+		entry = _compact_node(tab, f.Link);
+		_compact_push(&c, &entry->Next, f.Length);
+		_compact_push(&c, &entry->Children, _compact_key(&c, entry, f.Length));
+	}
+
+	free(tab->Compact);
+	tab->Compact = c.Top ? strdup(c.Key.Buffer) : NULL;
+	if(!c.Top && tab->Arena)
+	{
+		_arena_unref(tab->Arena);
+		tab->Arena = NULL;
+	}
+
+	free(c.Stack);
+	free(c.Key.Buffer);
+	return c.Top != 0;
+}
+
+SymTab *symtab_snapshot(SymTab *tab)
+{
+	SymTab *snap = calloc(1, sizeof(*snap));
+	assert(!tab->Frozen);
+	_node_ref(tab->Root);
+	snap->Root = tab->Root;
+	snap->ReadOnly = 1;
+	snap->Shared = 1;
+	snap->Count = tab->Count;
+	snap->Bytes = tab->Bytes;
+	snap->Dict = _dict_copy(tab->Dict);
+	snap->Fold = _fold_copy(tab->Fold);
+	tab->Shared = 1;
+	return snap;
+}
+
+SymTab *symtab_freeze(const SymTab *tab)
+{
+	SymTab *frozen = calloc(1, sizeof(*frozen));
+	SymIter it;
+	SymIterFrame frame;
+	const SymNode *entry;
+	SymFreeze *stack;
+	size_t nodes = 1, top = 0;
+	size_t size = _frozen_size(tab->Root);
+	char *p;
+
+	_iter_init(&it, tab->Root->Children);
+	while((entry = _iter_next(&it, &frame)))
+	{
+		size += _frozen_size(entry);
+		++nodes;
+	}
+
+	_iter_free(&it);
+
+	/* Copy in pre-order: a node is followed by its first child, so a
+		lookup moves forward through one block of memory */
+	p = frozen->Block = _block_alloc(tab->Huge, size, &frozen->Mapped);
+	stack = malloc(nodes * sizeof(*stack));
+	stack[top].Node = tab->Root;
+	stack[top++].Link = &frozen->Root;
+	while(top)
+	{
+		SymFreeze f = stack[--top];
+		SymNode *copy = (SymNode *)p;
+		memcpy(copy, f.Node, _node_size(f.Node));
+		copy->Next = NULL;
+		copy->Children = NULL;
+		copy->RefCount = 1;
+		copy->Flags = 0;
+		*f.Link = copy;
+		p += _frozen_size(copy);
+		if(f.Node->Next)
+		{
+			stack[top].Node = f.Node->Next;
+			stack[top++].Link = &copy->Next;
+		}
+
+		if(f.Node->Children)
+		{
+			stack[top].Node = f.Node->Children;
+			stack[top++].Link = &copy->Children;
+		}
+	}
+
+	free(stack);
+	frozen->ReadOnly = 1;
+	frozen->Frozen = 1;
+	frozen->Count = tab->Count;
+	frozen->Bytes = size;
+	frozen->Dict = _dict_copy(tab->Dict);
+	frozen->Fold = _fold_copy(tab->Fold);
+	frozen->Huge = tab->Huge;
+	frozen->Hash = _hash_build(frozen, &frozen->HashMapped);
+	return frozen;
 }
 
-static inline int _is_leaf(const SymNode *entry)
+int symtab_compress(SymTab *tab, const char *const *samples, size_t count)
 {
-	return entry->Value;
-}
+	if(tab->Count || tab->ReadOnly || tab->Dict || tab->Fold)
+	{
+		return -1;
+	}
 
-static inline int _is_last(const SymNode *entry)
-{
-	return entry->Next == NULL;
+	tab->Dict = malloc(sizeof(*tab->Dict));
+	_dict_train(tab->Dict, samples, count);
+	return 0;
 }
 
-static inline int _has_children(const SymNode *entry)
+void symtab_huge_pages(SymTab *tab)
 {
-	return entry->Children != NULL;
+	tab->Huge = 1;
 }
 
-static inline int _has_exactly_one_child(const SymNode *entry)
+int symtab_fold(SymTab *tab, const unsigned char *map)
 {
-	return _has_children(entry) && _is_last(entry->Children);
+	int c;
+	if(tab->Count || tab->ReadOnly || tab->Dict || tab->Fold)
+	{
+		return -1;
+	}
+
+	/* Folded keys must stay the same when they are folded again */
+	for(c = 0; map && c < 256; ++c)
+	{
+		if(!c != !map[c] || map[map[c]] != map[c])
+		{
+			return -1;
+		}
+	}
+
+	tab->Fold = malloc(256);
+	for(c = 0; c < 256; ++c)
+	{
+		tab->Fold[c] = map ? map[c] : c >= 'A' && c <= 'Z' ? c + 32 : c;
+	}
+
+	return 0;
 }
 
-static SymNode *_new_leaf(const char *label, int value)
+void symtab_bloom(SymTab *tab)
 {
-	size_t label_size = strlen(label) + 1;
-	SymNode *n = _entry_new(label_size);
-	memcpy(n->Label, label, label_size);
-	n->Value = value;
-	return n;
+	assert(!tab->Frozen);
+	if(!tab->Bloom)
+	{
+		tab->Bloom = calloc(1, sizeof(*tab->Bloom));
+		_bloom_rebuild(tab);
+	}
 }
 
-static SymNode *_entry_split(SymNode *entry, char *pos, SymNode **child)
+void symtab_hot_cache(SymTab *tab)
 {
-	SymNode *second = _new_leaf(pos, entry->Value);
-	*pos = '\0';
-	second->Children = entry->Children;
-	entry->Children = second;
-	*child = second;
-	return realloc(entry, _calc_size(pos - entry->Label + 1));
+	/* Whole cache lines, for aligned_alloc */
+	size_t size = (sizeof(*tab->Hot) + 63) & ~(size_t)63;
+
+	/* Snapshots and frozen tables may have concurrent readers, every get
+		would write to the cache */
+	assert(!tab->ReadOnly);
+	if(!tab->Hot && !tab->ReadOnly)
+	{
+		tab->Hot = aligned_alloc(64, size);
+		memset(tab->Hot, 0, size);
+	}
 }
 
-static SymNode *_entry_split_for_child(
-	SymNode *entry, char *pos, const char *label, int value)
+void symtab_hot_stats(const SymTab *tab, SymHotStats *stats)
 {
-	SymNode *n = _new_leaf(label, value);
-	SymNode *second;
-	entry = _entry_split(entry, pos, &second);
-	entry->Value = 0;
-	second->Next = n;
-	return entry;
+	stats->Hits = tab->Hot ? tab->Hot->Hits : 0;
+	stats->Misses = tab->Hot ? tab->Hot->Misses : 0;
 }
 
-static SymNode *_entry_split_for_prefix(SymNode *entry, char *pos, int value)
+void symtab_cache_stats(const SymTab *tab, SymCacheStats *stats)
 {
-	SymNode *second;
-	entry = _entry_split(entry, pos, &second);
-	entry->Value = value;
-	return entry;
+	stats->Hits = tab->Hits;
+	stats->Misses = tab->Misses;
+	stats->Evictions = tab->Evictions;
+	stats->Keys = tab->Count;
+	stats->Bytes = tab->Bytes;
 }
 
-static SymNode *_entry_merge(SymNode *parent, SymNode *child)
+void symtab_stats(const SymTab *tab, SymStats *out)
 {
-	size_t parent_len = strlen(parent->Label);
-	size_t child_len = strlen(child->Label);
-	SymNode *merge = realloc(parent, _calc_size(parent_len + child_len + 1));
-	merge->Value = child->Value;
-	merge->Children = child->Children;
-	memcpy(merge->Label + parent_len, child->Label, child_len + 1);
-	free(child);
-	return merge;
+	_stats_begin(tab, out);
+	_stats(out, tab->Root->Children, 1, tab->Frozen);
+	_stats_end(tab, out);
 }
 
-static void _entry_remove(
-	SymNode *entry, SymNode **entry_ref,
-	SymNode *parent, SymNode **parent_ref)
+void symtab_stats_parallel(const SymTab *tab, SymStats *out, int threads)
 {
-	if(_has_children(entry))
-	{
-		entry->Value = 0;
-		if(_is_last(entry->Children))
-		{
-			*entry_ref = _entry_merge(entry, entry->Children);
-		}
-	}
-	else
+	SymParallel p;
+	SymTasks t;
+	int i;
+
+	threads = pool_threads(threads);
+	_stats_begin(tab, out);
+	_stats_list(out, tab->Root->Children);
+	p.Tab = tab;
+	p.Stats = calloc(threads, sizeof(*p.Stats));
+	_tasks_split(&t, tab->Root->Children, "", 0, 1,
+		threads * PARALLEL_TASKS, &p, _stats_expand);
+
+	p.Tasks = &t;
+	pool_run(t.Count, threads, &p, _stats_task);
+	for(i = 0; i < threads; ++i)
 	{
-		*entry_ref = entry->Next;
-		free(entry);
+		_stats_merge(out, &p.Stats[i]);
 	}
 
-	if(!_is_leaf(parent) && _has_exactly_one_child(parent))
+	free(p.Stats);
+	_tasks_free(&t);
+	_stats_end(tab, out);
+}
+
+int symtab_durable(SymTab *tab, const char *path, int sync_every)
+{
+	assert(!tab->Wal);
+	assert(!tab->ReadOnly);
+	if(wal_replay(path, tab, _replay_apply))
 	{
-		*parent_ref = _entry_merge(parent, parent->Children);
+		_clear(tab);
+		return -1;
 	}
+
+	tab->Wal = wal_open(path, sync_every);
+	return tab->Wal ? 0 : -1;
 }
 
-/* --- PUBLIC --- */
-SymNode *symtab_create(int capacity)
+int symtab_sync(SymTab *tab)
 {
-	SymNode *tab = _entry_new(1);
-	tab->Label[0] = '\0';
-	tab->Value = 42;
-	return tab;
-	(void)capacity;
+	return tab->Wal ? wal_sync(tab->Wal) : 0;
 }
 
-void symtab_destroy(SymNode *tab)
+int symtab_checkpoint(SymTab *tab)
 {
-	if(!tab)
+	int ok;
+	if(!tab->Wal)
 	{
-		return;
+		return 0;
 	}
 
-	symtab_destroy(tab->Next);
-	symtab_destroy(tab->Children);
-	free(tab);
+	if(wal_image_begin(tab->Wal))
+	{
+		return -1;
+	}
+
+	ok = !_walk(tab->Root->Children, tab->Dict, tab->Wal, _checkpoint_put);
+	return wal_image_end(tab->Wal, ok);
 }
 
-int symtab_put(SymNode *entry, const char *ident, int value)
+int symtab_put(SymTab *tab, const char *ident, int value)
 {
-	SymNode **ref = NULL;
+	SymNode **ref = &tab->Root;
+	SymNode *entry;
+	char buf[DICT_BUFFER];
+	const char *plain = ident;
+	const char *key;
 	int prev_value = 0;
 
+	/* Before any node is copied: snapshots share their nodes and generated
+		tables are const */
 	assert(value != 0);
+	assert(!tab->ReadOnly);
+	if(tab->ReadOnly)
+	{
+		return 0;
+	}
+
+	entry = _node_unique(tab, ref);
+	key = _key_encode(tab, ident, buf);
+	STAT(++tab->Ops[OP_PUT]);
+	ident = key;
 	while(entry)
 	{
-		const char *search = ident;
-		char *edge = entry->Label;
-		while(*edge && *search && *edge == *search)
-		{
-			++edge;
-			++search;
-		}
+		size_t n = _common(entry->Label, ident, tab->Fold);
+		const char *search = ident + n;
+		char *edge = entry->Label + n;
+		STAT(++tab->Visits[OP_PUT]);
 
 		if(!*edge)
 		{
@@ -191,13 +2983,13 @@ int symtab_put(SymNode *entry, const char *ident, int value)
 			}
 			else if(!_has_children(entry))
 			{
-				entry->Children = _new_leaf(search, value);
+				entry->Children = _new_leaf(tab, search, value);
 				entry = NULL;
 			}
 			else
 			{
 				ref = &entry->Children;
-				entry = entry->Children;
+				entry = _node_unique(tab, ref);
 				ident = search;
 			}
 		}
@@ -205,55 +2997,114 @@ int symtab_put(SymNode *entry, const char *ident, int value)
 		{
 			if(_is_last(entry))
 			{
-				entry->Next = _new_leaf(search, value);
+				entry->Next = _new_leaf(tab, search, value);
 				entry = NULL;
 			}
 			else
 			{
 				ref = &entry->Next;
-				entry = entry->Next;
+				entry = _node_unique(tab, ref);
 			}
 		}
 		else
 		{
 			if(*search)
 			{
-				*ref = _entry_split_for_child(entry, edge, search, value);
+				*ref = _entry_split_for_child(tab, entry, edge, search, value);
 			}
 			else
 			{
-				*ref = _entry_split_for_prefix(entry, edge, value);
+				*ref = _entry_split_for_prefix(tab, entry, edge, value);
 			}
 
 			entry = NULL;
 		}
 	}
 
+	/* Errors stay in the log until symtab_sync reports them */
+	if(tab->Wal)
+	{
+		wal_append(tab->Wal, plain, value);
+	}
+
+	if(prev_value && tab->Hot)
+	{
+		SymHotSlot *slot = _hot_find(tab->Hot, _hash(key, tab->Fold), key,
+			tab->Fold);
+		if(slot)
+		{
+			slot->Value = value;
+		}
+	}
+
+	if(!prev_value)
+	{
+		++tab->Count;
+		if(tab->Bloom)
+		{
+			if(tab->Count > tab->Bloom->Planned || tab->Bloom->Stale)
+			{
+				_bloom_rebuild(tab);
+			}
+			else
+			{
+				_bloom_add(tab->Bloom, _hash(key, tab->Fold));
+			}
+		}
+
+		while(_over_budget(tab) && tab->Count)
+		{
+			_evict(tab);
+		}
+	}
+
+	_key_done(key, plain, buf);
 	return prev_value;
 }
 
-int symtab_remove(SymNode *entry, const char *ident)
+int symtab_remove(SymTab *tab, const char *ident)
 {
 	int prev_value = 0;
 	SymNode *parent = NULL;
-	SymNode **entry_ref = NULL;
+	SymNode **entry_ref = &tab->Root;
 	SymNode **parent_ref = NULL;
+	SymNode *entry;
+	char buf[DICT_BUFFER];
+	const char *plain = ident;
+	const char *key;
+
+	assert(!tab->ReadOnly);
+	if(tab->ReadOnly)
+	{
+		return 0;
+	}
+
+	key = _key_encode(tab, ident, buf);
+	ident = key;
+
+	/* Don't copy the path of a shared tree for a symbol that doesn't exist */
+	STAT(++tab->Ops[OP_REMOVE]);
+	if(tab->Shared &&
+		!_find(tab->Root, ident, tab->Fold, &tab->Visits[OP_REMOVE]))
+	{
+		_key_done(key, plain, buf);
+		return 0;
+	}
+
+	entry = _node_unique(tab, entry_ref);
 	while(entry)
 	{
-		const char *search = ident;
-		const char *edge = entry->Label;
-		while(*edge && *search && *edge == *search)
-		{
-			++edge;
-			++search;
-		}
+		size_t n = _common(entry->Label, ident, tab->Fold);
+		const char *search = ident + n;
+		const char *edge = entry->Label + n;
+		STAT(++tab->Visits[OP_REMOVE]);
 
 		if(!*edge)
 		{
 			if(!*search && _is_leaf(entry))
 			{
 				prev_value = entry->Value;
-				_entry_remove(entry, entry_ref, parent, parent_ref);
+				_entry_remove(tab, entry, entry_ref, parent, parent_ref);
 				entry = NULL;
 			}
 			else
@@ -261,68 +3112,216 @@ int symtab_remove(SymNode *entry, const char *ident)
 				parent_ref = entry_ref;
 				parent = entry;
 				entry_ref = &entry->Children;
-				entry = *entry_ref;
+				entry = _node_unique(tab, entry_ref);
 				ident = search;
 			}
 		}
 		else
 		{
 			entry_ref = &entry->Next;
-			entry = *entry_ref;
+			entry = _node_unique(tab, entry_ref);
+		}
+	}
+
+	if(prev_value)
+	{
+		--tab->Count;
+		_hot_drop(tab->Hot, key, tab->Fold);
+
+		/* Removed symbols stay in the filter until it is rebuilt, which is
+			left to the next get or put so that a run of removes pays once */
+		if(tab->Bloom && ++tab->Bloom->Removed > tab->Count / 4 + 64)
+		{
+			tab->Bloom->Stale = 1;
+		}
+
+		/* Errors stay in the log until symtab_sync reports them */
+		if(tab->Wal)
+		{
+			wal_append(tab->Wal, plain, 0);
 		}
 	}
 
+	_key_done(key, plain, buf);
 	return prev_value;
 }
 
-int symtab_get(const SymNode *entry, const char *ident)
+int symtab_get(const SymTab *tab, const char *ident)
 {
-	int prev_value = 0;
+	char buf[DICT_BUFFER];
+	const char *key;
+	int value;
+	if(!tab->Dict)
+	{
+		return _get(tab, ident);
+	}
+
+	key = _key_encode(tab, ident, buf);
+	value = _get(tab, key);
+	_key_done(key, ident, buf);
+	return value;
+}
+
+int symtab_longest_prefix(const SymTab *tab, const char *ident,
+	size_t *matched_len)
+{
+	const SymNode *entry = tab->Root->Children;
+	const char *key = ident;
+	int value = 0;
+	size_t len = 0;
+	assert(!tab->Dict);
 	while(entry)
 	{
-		const char *search = ident;
-		const char *edge = entry->Label;
-		while(*edge && *search && *edge == *search)
+		size_t n = _common(entry->Label, ident, tab->Fold);
+		const char *search = ident + n;
+		const char *edge = entry->Label + n;
+		if(!*edge)
 		{
-			++edge;
-			++search;
+			if(_is_leaf(entry))
+			{
+				value = entry->Value;
+				len = search - key;
+			}
+
+			ident = search;
+			entry = *search ? entry->Children : NULL;
+		}
+		else if(edge == entry->Label)
+		{
+			entry = entry->Next;
+		}
+		else
+		{
+			/* Diverged inside the label, no deeper key can be a prefix */
+			entry = NULL;
 		}
+	}
 
-		if(!*edge)
+	if(matched_len)
+	{
+		*matched_len = len;
+	}
+
+	return value;
+}
+
+int symtab_scan(const SymTab *tab, const char *text, size_t len, void *data,
+	void (*callback)(void *data, size_t offset, size_t len, int value))
+{
+	const char *end = text + len;
+	const char *pos;
+	const SymNode *entry;
+	unsigned char single[256] = { 0 };
+	uint64_t pairs[65536 / 64] = { 0 };
+	int results = 0;
+
+	assert(!tab->Dict && !tab->Fold);
+
+	/* Most positions can be skipped by looking at two bytes: `pairs` has
+		a bit for the first two bytes of every symbol, `single` marks the
+		symbols that are only one byte long */
+	for(entry = tab->Root->Children; entry; entry = entry->Next)
+	{
+		unsigned c = (unsigned char)entry->Label[0] << 8;
+		if(entry->Label[1])
 		{
-			if(!*search && _is_leaf(entry))
+			c |= (unsigned char)entry->Label[1];
+			pairs[c >> 6] |= (uint64_t)1 << (c & 63);
+		}
+		else
+		{
+			const SymNode *child;
+			single[c >> 8] = _is_leaf(entry);
+			for(child = entry->Children; child; child = child->Next)
 			{
-				prev_value = entry->Value;
-				entry = NULL;
+				unsigned d = c | (unsigned char)child->Label[0];
+				pairs[d >> 6] |= (uint64_t)1 << (d & 63);
 			}
-			else
+		}
+	}
+
+	for(pos = text; pos < end; ++pos)
+	{
+		const char *search = pos;
+		unsigned c = (unsigned char)pos[0] << 8;
+		if(!single[c >> 8])
+		{
+			if(pos + 1 == end)
 			{
-				ident = search;
-				entry = entry->Children;
+				break;
+			}
+
+			c |= (unsigned char)pos[1];
+			if(!(pairs[c >> 6] & ((uint64_t)1 << (c & 63))))
+			{
+				continue;
 			}
 		}
-		else
+
+		entry = tab->Root->Children;
+		while(entry)
 		{
-			entry = entry->Next;
+			const char *edge = entry->Label;
+			while(*edge && search < end && *edge == *search)
+			{
+				++edge;
+				++search;
+			}
+
+			if(!*edge)
+			{
+				if(_is_leaf(entry))
+				{
+					callback(data, pos - text, search - pos, entry->Value);
+					++results;
+				}
+
+				entry = entry->Children;
+			}
+			else if(edge == entry->Label)
+			{
+				entry = entry->Next;
+			}
+			else
+			{
+				entry = NULL;
+			}
 		}
 	}
 
-	return prev_value;
+	return results;
 }
 
-int symtab_complete(const SymNode *entry, char *ident)
+int symtab_complete(const SymTab *tab, char *ident)
 {
+	const SymNode *entry = tab->Root;
 	int modified = 0;
-	while(entry)
+	if(tab->Dict)
 	{
-		char *search = ident;
-		const char *edge = entry->Label;
-		while(*edge && *search && *edge == *search)
+		SymDictPrefix dp;
+		size_t len = strlen(ident);
+		dp.Ident = ident;
+		dp.Results = 0;
+		dp.Common.Buffer = NULL;
+		dp.Common.Capacity = 0;
+		_dict_prefix(tab, ident, &dp, _dict_complete);
+		if(dp.Results && dp.Length > len)
 		{
-			++edge;
-			++search;
+			memcpy(ident + len, dp.Common.Buffer + len, dp.Length - len);
+			ident[dp.Length] = '\0';
+			modified = 1;
 		}
 
+		free(dp.Common.Buffer);
+		return modified;
+	}
+
+	while(entry)
+	{
+		size_t n = _common(entry->Label, ident, tab->Fold);
+		char *search = ident + n;
+		const char *edge = entry->Label + n;
+
 		if(!*edge)
 		{
 			if(!*search)
@@ -356,18 +3355,177 @@ int symtab_complete(const SymNode *entry, char *ident)
 	return modified;
 }
 
-int symtab_prefix_iter(const SymNode *entry, char *ident, int max_results,
+int symtab_fuzzy(const SymTab *tab, const char *query, int max_edits,
+	int max_results, void *data,
+	void (*callback)(void *data, const char *ident, int value, int distance))
+{
+	SymFuzzy f;
+	int j, *row;
+
+	assert(!tab->Dict && !tab->Fold);
+	f.Query = query;
+	f.Length = strlen(query);
+	f.MaxEdits = max_edits;
+	f.MaxResults = max_results ? max_results : -1;
+	f.Results = 0;
+	f.Rows = NULL;
+	f.RowCount = 0;
+	f.Key.Buffer = NULL;
+	f.Key.Capacity = 0;
+	f.Data = data;
+	f.Callback = callback;
+
+	row = _fuzzy_row(&f, 0);
+	for(j = 0; j <= f.Length; ++j)
+	{
+		row[j] = j;
+	}
+
+	_fuzzy(&f, tab->Root->Children, 0);
+	free(f.Rows);
+	free(f.Key.Buffer);
+	return f.Results;
+}
+
+int symtab_match(const SymTab *tab, const char *pattern, void *data,
+	void (*callback)(void *data, const char *ident, int value))
+{
+	SymMatch *m;
+	int results = -1;
+
+	assert(!tab->Dict && !tab->Fold);
+	m = malloc(sizeof(*m));
+	if(_match_compile(m, pattern) >= 0)
+	{
+		m->Results = 0;
+		m->Key.Buffer = NULL;
+		m->Key.Capacity = 0;
+		m->Data = data;
+		m->Callback = callback;
+		_match(m, tab->Root->Children, 0, _match_closure(m, 1));
+		results = m->Results;
+		free(m->Key.Buffer);
+	}
+
+	free(m);
+	return results;
+}
+
+int symtab_prefix_iter(const SymTab *tab, char *ident, int max_results,
 	void *data, void (*callback)(void *data, char *ident))
 {
-	int num_results = 0;
+	SymIter it;
+	SymIterFrame frame;
+	size_t prefix_len = strlen(ident);
+	size_t len;
+	int results = 0;
+	const SymNode *entry;
+	if(tab->Dict)
+	{
+		SymDictPrefix dp;
+		char *prefix = malloc(prefix_len + 1);
+		memcpy(prefix, ident, prefix_len + 1);
+		dp.Ident = ident;
+		dp.Results = 0;
+		dp.MaxResults = max_results ? max_results : -1;
+		dp.Data = data;
+		dp.Callback = callback;
+		_dict_prefix(tab, prefix, &dp, _dict_iter);
+		memcpy(ident, prefix, prefix_len + 1);
+		free(prefix);
+		return dp.Results;
+	}
+
+	_fold(ident, tab->Fold);
+	entry = _prefix_find(tab->Root, ident, NULL, &len);
+	if(!entry)
+	{
+		return 0;
+	}
+
+	/* The label continues the prefix, so the keys are built in place */
+	strcpy(ident + len, entry->Label);
+	len += strlen(entry->Label);
+	if(entry != tab->Root && _is_leaf(entry))
+	{
+		callback(data, ident);
+		++results;
+	}
+
+	max_results = max_results ? max_results : -1;
+	_iter_init(&it, entry->Children);
+	while(results != max_results && (entry = _iter_next(&it, &frame)))
+	{
+		if(_is_leaf(entry))
+		{
+			memcpy(ident + len, it.Key.Buffer,
+				frame.Length + strlen(entry->Label) + 1);
+			callback(data, ident);
+			++results;
+		}
+	}
+
+	_iter_free(&it);
+	ident[prefix_len] = '\0';
+	return results;
+}
+
+int symtab_prefix_iter_parallel(const SymTab *tab, const char *prefix,
+	int threads, void *data,
+	void (*callback)(void *data, int worker, const char *ident, int value))
+{
+	SymParallel p;
+	SymTasks t;
+	SymKey key;
+	size_t base, len;
+	int i, results = 0;
+	const SymNode *entry;
+
+	assert(!tab->Dict);
+	entry = _prefix_find(tab->Root, prefix, tab->Fold, &base);
+	if(!entry)
+	{
+		return 0;
+	}
+
+	threads = pool_threads(threads);
+	p.Tab = tab;
+	p.Keys = calloc(threads, sizeof(*p.Keys));
+	p.Results = calloc(threads, sizeof(*p.Results));
+	p.Data = data;
+	p.Callback = callback;
+
+	/* The key above the children is the (folded) prefix up to the node
+		followed by its label */
+	key.Buffer = NULL;
+	key.Capacity = 0;
+	len = base + strlen(entry->Label);
+	_key_reserve(&key, len + 1);
+	memcpy(key.Buffer, prefix, base);
+	key.Buffer[base] = '\0';
+	_fold(key.Buffer, tab->Fold);
+	if(entry != tab->Root)
+	{
+		_prefix_report(&p, 0, entry, key.Buffer, base);
+	}
 
-	/* TODO: Implement prefix iteration functionality */
-	(void)entry;
-	(void)ident;
-	(void)max_results;
-	(void)data;
-	(void)callback;
-	return num_results;
+	strcpy(key.Buffer + base, entry->Label);
+	_tasks_split(&t, entry->Children, key.Buffer, len, 1,
+		threads * PARALLEL_TASKS, &p, _prefix_expand);
+
+	free(key.Buffer);
+	p.Tasks = &t;
+	pool_run(t.Count, threads, &p, _prefix_task);
+	for(i = 0; i < threads; ++i)
+	{
+		results += p.Results[i];
+		free(p.Keys[i].Buffer);
+	}
+
+	_tasks_free(&t);
+	free(p.Results);
+	free(p.Keys);
+	return results;
 }
 
 #ifdef SYMTAB_DEBUG
@@ -380,26 +3538,26 @@ static void _nspaces(int n)
 	}
 }
 
-static void _symtab_print(const SymNode *entry, int nesting)
+void symtab_print(const SymTab *tab)
 {
-	while(entry)
+	SymIter it;
+	SymIterFrame frame;
+	const SymNode *entry;
+	_iter_init(&it, tab->Root->Children);
+	it.Dict = tab->Dict;
+	while((entry = _iter_next(&it, &frame)))
 	{
-		_nspaces(4 * nesting);
-		printf("- %s", entry->Label);
+		_nspaces(4 * (frame.Depth - 1));
+		printf("- %s", it.Key.Buffer + frame.Length);
 		if(_is_leaf(entry))
 		{
 			printf(" = %d", entry->Value);
 		}
 
 		printf("\n");
-		_symtab_print(entry->Children, nesting + 1);
-		entry = entry->Next;
 	}
-}
 
-void symtab_print(const SymNode *tab)
-{
-	_symtab_print(tab->Children, 0);
+	_iter_free(&it);
 }
 
 #endif /* SYMTAB_DEBUG */
@@ -14,6 +14,13 @@
 
 #define SYMTAB_DEBUG
 
+/* Count operations and visited nodes for symtab_stats. Every lookup then
+	writes to the table, the test build defines it in the Makefile */
+/* #define SYMTAB_STATS */
+
+/* Number of buckets of the symtab_stats histograms */
+#define SYMTAB_HISTOGRAM 16
+
 #define SYMTAB_IMPL_TREE  1
 #define SYMTAB_IMPL_ARRAY 2
 
@@ -22,9 +29,69 @@
 /* Symbol table interface */
 typedef struct SYMTAB SymTab;
 
+/* Read replicas of a symbol table, see `symtab_replicas_create` */
+typedef struct SYMREPLICAS SymReplicas;
+
+/* Counters of a cache table */
+typedef struct
+{
+	unsigned long Hits;
+	unsigned long Misses;
+	unsigned long Evictions;
+	size_t Keys;
+	size_t Bytes;
+} SymCacheStats;
+
+/* Counters of the hot cache, see `symtab_hot_cache` */
+typedef struct
+{
+	unsigned long Hits;
+	unsigned long Misses;
+} SymHotStats;
+
+/* Shape, memory usage and operation counters of a symbol table */
+typedef struct
+{
+	/* Number of nodes, including the root */
+	size_t Nodes;
+
+	/* Number of symbols */
+	size_t Leaves;
+
+	/* Total length of all node labels */
+	size_t LabelBytes;
+
+	/* Memory requested for the nodes */
+	size_t NodeBytes;
+
+	/* Memory used by the allocator on top of `NodeBytes` */
+	size_t AllocatorBytes;
+
+	/* Number of symbols per node depth (`Depth[1]`: direct children of the
+		root), the last bucket also counts deeper symbols */
+	size_t Depth[SYMTAB_HISTOGRAM];
+
+	/* Number of sibling lists per length, `Siblings[i]` counts lists
+		with a length between 2^i and 2^(i + 1) - 1 */
+	size_t Siblings[SYMTAB_HISTOGRAM];
+
+	/* Operations since the table was created (with SYMTAB_STATS only,
+		frozen tables don't count them) */
+	unsigned long Gets;
+	unsigned long Puts;
+	unsigned long Removes;
+
+	/* Average number of nodes visited per operation */
+	double GetVisits;
+	double PutVisits;
+	double RemoveVisits;
+} SymStats;
+
 /**
  * @brief Create a symbol table
  *
+ * @param capacity Maximum number of symbols for the array implementation,
+ *                 the tree grows as needed (see `symtab_create_cache`)
  * @return Pointer to symbol table allocated on the heap
  */
 SymTab *symtab_create(int capacity);
@@ -36,6 +103,329 @@ SymTab *symtab_create(int capacity);
  */
 void symtab_destroy(SymTab *tab);
 
+#if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
+
+/**
+ * @brief Frees a symbol table incrementally, to avoid long pauses when
+ *        destroying large tables. After the first call the table must not
+ *        be used anymore, except for further calls to this function.
+ *
+ * @param tab Pointer to Symbol Table
+ * @param budget Maximum number of nodes to free in this call
+ * @return 1 if there is more to free, 0 if the table is completely freed
+ */
+int symtab_destroy_step(SymTab *tab, size_t budget);
+
+/**
+ * @brief Frees a symbol table on several threads. The tree is split into
+ *        subtrees that are handed out through a work-stealing pool.
+ *        Tables that share nodes with a snapshot are freed serially.
+ *
+ * @param tab Pointer to Symbol Table
+ * @param threads Number of threads, 0 for one per online CPU
+ */
+void symtab_destroy_parallel(SymTab *tab, int threads);
+
+/**
+ * @brief Creates a symbol table from many symbols at once. The symbols are
+ *        partitioned by their first byte, the partitions are inserted into
+ *        separate trees on worker threads, and the top-level lists of the
+ *        trees are joined under one root. Symbols that all start with the
+ *        same byte end up in one partition and are not built in parallel.
+ *
+ * @param idents Symbol identifiers, later duplicates overwrite earlier ones
+ * @param values Symbol values, none of them 0
+ * @param count Number of symbols
+ * @param threads Number of threads, 0 for one per online CPU
+ * @return Pointer to symbol table allocated on the heap
+ */
+SymTab *symtab_build(const char *const *idents, const int *values,
+	size_t count, int threads);
+
+/**
+ * @brief Moves the nodes of a table into contiguous memory in pre-order
+ *        (a node is followed by its first child, like in a frozen table),
+ *        undoing the scattering of nodes over the heap by many puts and
+ *        removes. The work is done incrementally: each call copies at most
+ *        `budget` nodes and remembers where it stopped, so it can run from
+ *        a maintenance tick between other operations. Calling it again
+ *        after it returned 0 starts a new pass. Nodes shared with a
+ *        snapshot are not moved.
+ *
+ * @param tab Pointer to Symbol Table
+ * @param budget Maximum number of nodes to visit in this call
+ * @return 1 if the pass is not complete yet, 0 if it is
+ */
+int symtab_compact(SymTab *tab, size_t budget);
+
+#endif
+
+#if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
+
+/**
+ * @brief Create a bounded symbol table for use as a cache. When `symtab_put`
+ *        inserts a symbol that exceeds one of the limits, symbols are
+ *        evicted using the CLOCK algorithm: `symtab_get` marks a symbol as
+ *        referenced, and the clock hand gives referenced symbols a second
+ *        chance while it sweeps the tree.
+ *
+ * @param max_keys Maximum number of symbols (0 for unlimited)
+ * @param max_bytes Maximum memory used by the nodes (0 for unlimited)
+ * @return Pointer to symbol table allocated on the heap
+ */
+SymTab *symtab_create_cache(size_t max_keys, size_t max_bytes);
+
+/**
+ * @brief Compresses the labels of an empty table with a dictionary of up to
+ *        127 frequent substrings (of 2 to 8 bytes), trained on sample
+ *        symbols. Each key is encoded once per `symtab_put`, `symtab_get`
+ *        or `symtab_remove`, by replacing the longest dictionary word at
+ *        each position with a one byte code; the tree then works on the
+ *        encoded keys. `symtab_complete`, `symtab_prefix_iter` and the other
+ *        functions that return keys decode the labels on the fly.
+ *        `symtab_longest_prefix`, `symtab_scan`, `symtab_fuzzy`,
+ *        `symtab_match` and `symtab_prefix_iter_parallel` are not supported
+ *        on compressed tables.
+ *
+ * @param tab Empty symbol table
+ * @param samples Sample symbols, for example the first symbols to insert
+ * @param count Number of samples (at most 1024 are used)
+ * @return 0 on success, -1 if the table is not empty, already compressed
+ *         or folds keys
+ */
+int symtab_compress(SymTab *tab, const char *const *samples, size_t count);
+
+/**
+ * @brief Makes an empty table fold keys, for example to ignore case: all
+ *        keys that are the same after mapping every byte with `map` are
+ *        the same symbol. The labels are stored folded, and `symtab_get`,
+ *        `symtab_put`, `symtab_remove`, `symtab_complete`,
+ *        `symtab_longest_prefix` and the prefix iteration fold the bytes
+ *        of the key while comparing, without copying it. Keys passed to
+ *        callbacks are folded. `symtab_scan`, `symtab_fuzzy` and
+ *        `symtab_match` are not supported, and a table can't both fold
+ *        and compress keys.
+ *
+ * @param tab Empty symbol table
+ * @param map Folded value of every byte, NULL for ASCII lowercase. Only 0
+ *            may map to 0, and folded bytes must map to themselves.
+ * @return 0 on success, -1 if the table is not empty, already folds or
+ *         compresses keys, or `map` is invalid
+ */
+int symtab_fold(SymTab *tab, const unsigned char *map);
+
+/**
+ * @brief Takes the memory for the nodes from 2 MB huge pages, so that
+ *        lookups in a large table need fewer TLB entries: `symtab_compact`
+ *        copies the nodes into 2 MB chunks, and `symtab_freeze` (and the
+ *        replicas made by it) puts the frozen copy in huge pages. Explicit
+ *        huge pages (`MAP_HUGETLB`) are used if the system has free ones,
+ *        otherwise the memory is marked for transparent huge pages, and
+ *        if it can't be mapped at all it comes from the heap. Nodes made
+ *        by `symtab_put` stay on the heap until the next compaction.
+ *
+ * @param tab Symbol table
+ */
+void symtab_huge_pages(SymTab *tab);
+
+/**
+ * @brief Puts a blocked bloom filter in front of the tree, so that most
+ *        `symtab_get` calls for symbols that don't exist return after
+ *        reading a single cache line. The filter is updated by `symtab_put`
+ *        and rebuilt when the table has doubled in size or after enough
+ *        `symtab_remove` calls have made it stale.
+ *
+ * @param tab Symbol table
+ */
+void symtab_bloom(SymTab *tab);
+
+/**
+ * @brief Puts a small cache of recently found symbols (256 sets of two,
+ *        16 KiB) in front of the tree, so that `symtab_get` finds
+ *        frequently used symbols without walking the sibling lists.
+ *        `symtab_put` and `symtab_remove` update the cache, and in a cache
+ *        table a cached symbol counts as referenced for the CLOCK hand.
+ *        Symbols with keys of 24 bytes or more are not cached.
+ *        `symtab_get` updates the cache, so the table must not be read
+ *        from several threads at once.
+ *
+ * @param tab Symbol table, not a snapshot or frozen table
+ */
+void symtab_hot_cache(SymTab *tab);
+
+/**
+ * @brief Get the hit and miss counters of the hot cache, 0 if the table
+ *        has none
+ *
+ * @param tab Symbol table
+ * @param stats Receives the counters
+ */
+void symtab_hot_stats(const SymTab *tab, SymHotStats *stats);
+
+/**
+ * @brief Get the hit, miss and eviction counters of a cache table
+ *
+ * @param tab Symbol table
+ * @param stats Receives the counters
+ */
+void symtab_cache_stats(const SymTab *tab, SymCacheStats *stats);
+
+/**
+ * @brief Collects statistics about the shape and memory usage of a symbol
+ *        table by walking all nodes. The operation counters are only
+ *        maintained when SYMTAB_STATS is defined, and are 0 otherwise.
+ *
+ * @param tab Symbol table
+ * @param out Receives the statistics
+ */
+void symtab_stats(const SymTab *tab, SymStats *out);
+
+/**
+ * @brief Same as `symtab_stats`, with the subtrees walked on several
+ *        threads
+ *
+ * @param tab Symbol table
+ * @param out Receives the statistics
+ * @param threads Number of threads, 0 for one per online CPU
+ */
+void symtab_stats_parallel(const SymTab *tab, SymStats *out, int threads);
+
+/**
+ * @brief Creates a read-only, point-in-time view of a symbol table in O(1).
+ *        The snapshot shares all nodes with `tab`; later writes to `tab`
+ *        copy the nodes on their path instead of modifying shared ones.
+ *        The snapshot may be read from another thread while `tab` is
+ *        being modified, and must be freed with `symtab_destroy`.
+ *
+ * @param tab Symbol table
+ * @return Snapshot of `tab`
+ */
+SymTab *symtab_snapshot(SymTab *tab);
+
+/**
+ * @brief Creates a frozen copy of a symbol table for read-mostly use. All
+ *        nodes are stored in pre-order in a single allocation, and a
+ *        minimal perfect hash index answers `symtab_get` with a single key
+ *        comparison. The copy is read-only; all other lookup functions
+ *        work as usual, and `symtab_get` may be called from many threads
+ *        at once. `symtab-gen` emits the same layout as C source for
+ *        tables that are known at build time.
+ *
+ * @param tab Symbol table
+ * @return Frozen copy of `tab`, to be freed with `symtab_destroy`
+ */
+SymTab *symtab_freeze(const SymTab *tab);
+
+/**
+ * @brief Creates read replicas of a table for machines with several NUMA
+ *        nodes: every node gets a frozen copy (see `symtab_freeze`) in its
+ *        own memory, made by a thread that runs on the node, and
+ *        `symtab_replicas_get` reads the copy of the node the calling
+ *        thread runs on. The nodes are read from sysfs; if there is only
+ *        one, or they can't be read, there is a single replica.
+ *
+ * @param tab Symbol table, which becomes the master copy that updates are
+ *            applied to. It is freed with the replicas and must not be
+ *            used directly anymore.
+ * @param nodes Number of replicas, 0 for one per NUMA node. With a number,
+ *              the CPUs are assigned to the replicas round-robin.
+ * @return Replicas, to be freed with `symtab_replicas_destroy`
+ */
+SymReplicas *symtab_replicas_create(SymTab *tab, int nodes);
+
+/**
+ * @brief Number of replicas
+ *
+ * @param r Replicas
+ * @return Number of replicas, at least 1
+ */
+int symtab_replicas_count(const SymReplicas *r);
+
+/**
+ * @brief Looks up a symbol in the replica of the caller's node. Any
+ *        number of threads may call this, also during updates.
+ *
+ * @param r Replicas
+ * @param ident Identifier
+ * @return Value of the symbol, 0 if it doesn't exist
+ */
+int symtab_replicas_get(SymReplicas *r, const char *ident);
+
+/**
+ * @brief Inserts or updates a symbol in the master copy. Readers see the
+ *        change after the next `symtab_replicas_publish`.
+ *
+ * @param r Replicas
+ * @param ident Identifier
+ * @param value Value, not 0
+ * @return Previous value in the master copy, 0 if the symbol is new
+ */
+int symtab_replicas_put(SymReplicas *r, const char *ident, int value);
+
+/**
+ * @brief Removes a symbol from the master copy. Readers see the change
+ *        after the next `symtab_replicas_publish`.
+ *
+ * @param r Replicas
+ * @param ident Identifier
+ * @return Previous value in the master copy, 0 if it didn't exist
+ */
+int symtab_replicas_remove(SymReplicas *r, const char *ident);
+
+/**
+ * @brief Makes the updates since the last call visible to readers: every
+ *        node gets a new frozen copy of the master, and the old copies
+ *        are freed once no reader uses them anymore. Does nothing if
+ *        there were no updates.
+ *
+ * @param r Replicas
+ */
+void symtab_replicas_publish(SymReplicas *r);
+
+/**
+ * @brief Frees the replicas and the master copy
+ *
+ * @param r Replicas
+ */
+void symtab_replicas_destroy(SymReplicas *r);
+
+/**
+ * @brief Makes a symbol table durable. The checkpoint image `path.img` and
+ *        the write-ahead log `path.log` are replayed into `tab`, after which
+ *        every `symtab_put` and `symtab_remove` appends a record to the log.
+ *        Records are committed in groups of `sync_every` with one fsync.
+ *        Put and remove don't report log errors, only `symtab_sync` does.
+ *
+ * @param tab Empty symbol table
+ * @param path Path prefix of the image and log files
+ * @param sync_every Number of operations per fsync: 1 to sync every
+ *                   operation, 0 to only write when the buffer is full and
+ *                   leave syncing to `symtab_sync`
+ * @return 0 on success, -1 on error (`tab` is left empty)
+ */
+int symtab_durable(SymTab *tab, const char *path, int sync_every);
+
+/**
+ * @brief Writes and syncs all buffered log records of a durable table.
+ *        After a failed write the log takes no more records, every put
+ *        and remove since then is lost on restart.
+ *
+ * @param tab Symbol table
+ * @return 0 on success, -1 if this or any earlier log write failed
+ */
+int symtab_sync(SymTab *tab);
+
+/**
+ * @brief Writes a compact checkpoint image of a durable table and truncates
+ *        the log. Should be called periodically to bound recovery time.
+ *
+ * @param tab Symbol table
+ * @return 0 on success, -1 on error
+ */
+int symtab_checkpoint(SymTab *tab);
+
+#endif
+
 /**
  * @brief Inserts or updates the value for a symbol
  *
@@ -64,6 +454,36 @@ int symtab_remove(SymTab *tab, const char *ident);
  */
 int symtab_get(const SymTab *tab, const char *ident);
 
+/**
+ * @brief Finds the longest symbol that is a prefix of `ident` (as needed for
+ *        routing tables) in a single descent. For CIDR style matching,
+ *        store prefixes as strings of '0' and '1' characters, one per bit.
+ *
+ * @param tab Symbol table
+ * @param ident Identifier to match
+ * @param matched_len Receives the length of the matching symbol (0 if there
+ *                    is none), may be NULL
+ * @return Value of the longest matching symbol, 0 if no symbol is a prefix
+ */
+int symtab_longest_prefix(const SymTab *tab, const char *ident,
+	size_t *matched_len);
+
+/**
+ * @brief Finds all occurrences of all symbols in a text. Starting at every
+ *        position, the tree is descended along the text until it diverges,
+ *        reporting every symbol passed on the way.
+ *
+ * @param tab Symbol table
+ * @param text Text to scan, does not have to be null-terminated
+ * @param len Length of the text
+ * @param data Pointer to custom data that is passed to the callback
+ * @param callback Callback function that is called with the offset, length
+ *                 and value of every occurrence, in order of the offset
+ * @return The number of times the callback was called
+ */
+int symtab_scan(const SymTab *tab, const char *text, size_t len, void *data,
+	void (*callback)(void *data, size_t offset, size_t len, int value));
+
 /**
  * @brief Autocomplete the given identifier up to the point
  *        where all contained symbols that have `ident` as a prefix
@@ -72,7 +492,8 @@ int symtab_get(const SymTab *tab, const char *ident);
  * @param tab Symbol table
  * @param ident Identifer that should be auto-completed. Because it
  *              is modified in place, `ident` should point to a buffer
- *              that is large enough to hold the longest entry in the table
+ *              that is large enough to hold the longest entry in the table.
+ *              The added part is folded if the table folds keys.
  * @return 1, if `ident` was modified
  */
 int symtab_complete(const SymTab *tab, char *ident);
@@ -85,7 +506,8 @@ int symtab_complete(const SymTab *tab, char *ident);
  * @param ident Prefix identifer that will be completed and passed
  *              to the callback. Because it is modified in place,
  *              `ident` should point to a buffer that is large enough to hold
- *              the longest entry in the table
+ *              the longest entry in the table. If the table folds keys,
+ *              the prefix is folded in place.
  * @param max_results Maximum number of results (0 for unlimited)
  * @param data Pointer to custom data that is passed to the callback
  * @param callback Callback function that is called with the completed
@@ -95,6 +517,66 @@ int symtab_complete(const SymTab *tab, char *ident);
 int symtab_prefix_iter(const SymTab *tab, char *ident, int max_results,
 	void *data, void (*callback)(void *data, char *ident));
 
+#if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
+
+/**
+ * @brief Calls the provided callback function for every symbol that has a
+ *        certain prefix, with the subtrees below the prefix distributed
+ *        over several threads. The callback is called concurrently, in no
+ *        particular order.
+ *
+ * @param tab Symbol table
+ * @param prefix Prefix of the symbols
+ * @param threads Number of threads, 0 for one per online CPU
+ * @param data Pointer to custom data that is passed to the callback
+ * @param callback Callback function that is called with the number of the
+ *                 calling thread (0 to `threads - 1`, for results without
+ *                 locking), the identifier and value of every symbol
+ * @return The number of times the callback was called
+ */
+int symtab_prefix_iter_parallel(const SymTab *tab, const char *prefix,
+	int threads, void *data,
+	void (*callback)(void *data, int worker, const char *ident, int value));
+
+/**
+ * @brief Calls the provided callback function for every symbol whose
+ *        Levenshtein distance to `query` is at most `max_edits`
+ *        ("did you mean" suggestions). Subtrees are skipped as soon as no
+ *        key below them can be within the distance.
+ *
+ * @param tab Symbol table
+ * @param query Identifier to search for
+ * @param max_edits Maximum number of inserted, deleted or changed characters
+ * @param max_results Maximum number of results (0 for unlimited)
+ * @param data Pointer to custom data that is passed to the callback
+ * @param callback Callback function that is called with the identifier,
+ *                 value and edit distance of every match
+ * @return The number of times the callback was called
+ */
+int symtab_fuzzy(const SymTab *tab, const char *query, int max_edits,
+	int max_results, void *data,
+	void (*callback)(void *data, const char *ident, int value, int distance));
+
+/**
+ * @brief Calls the provided callback function for every symbol that matches
+ *        a glob pattern. Supported are `*` (any string), `?` (any character),
+ *        character classes like `[abc]`, `[a-z]` and `[!0-9]`, and `\` to
+ *        escape the next character. Branches of the tree are skipped as soon
+ *        as a label conflicts with the pattern.
+ *
+ * @param tab Symbol table
+ * @param pattern Glob pattern of at most 63 tokens
+ * @param data Pointer to custom data that is passed to the callback
+ * @param callback Callback function that is called with the identifier
+ *                 and value of every match
+ * @return The number of times the callback was called,
+ *         -1 if the pattern is invalid or too long
+ */
+int symtab_match(const SymTab *tab, const char *pattern, void *data,
+	void (*callback)(void *data, const char *ident, int value));
+
+#endif
+
 #ifdef SYMTAB_DEBUG
 
 /**
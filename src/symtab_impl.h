@@ -0,0 +1,203 @@
+/**
+ * @file    symtab_impl.h
+ * @author  Anton Tchekov
+ * @version 0.1
+ * @date    2023-09-02
+ * @brief   Internal layout of the radix tree symbol table, shared by
+ *          symtab.c and the static tables emitted by symtab-gen
+ */
+
+#ifndef __SYMTAB_IMPL_H__
+#define __SYMTAB_IMPL_H__
+
+#include "symtab.h"
+#include "symtab_wal.h"
+
+/* Operations with per-operation counters */
+enum
+{
+	OP_GET,
+	OP_PUT,
+	OP_REMOVE,
+	OP_COUNT
+};
+
+/* Node flags */
+#define NODE_REFERENCED 0x01
+#define NODE_ARENA      0x02
+#define NODE_HUGE       0x04
+
+/**
+ * sizeof(SYMNODE):
+ *   - 64-bit: 25 bytes
+ *   - 32-bit: 17 bytes
+ *
+ * plus a variable number of bytes for the flexible array member
+ *
+ * `RefCount` is the number of pointers (parent, previous sibling or table
+ * root) that point to the node. Nodes with a count above one are shared
+ * with a snapshot and are copied before they are modified.
+ */
+struct SYMNODE
+{
+	struct SYMNODE *Next;
+	struct SYMNODE *Children;
+	int Value;
+	int RefCount;
+	unsigned char Flags;
+	char Label[];
+};
+
+typedef struct SYMNODE SymNode;
+
+/**
+ * Blocked bloom filter, all bits of a symbol are in the same
+ * 64 byte block so a test touches a single cache line
+ */
+typedef struct
+{
+	uint64_t *Blocks;
+	size_t Mask;
+	size_t Planned;
+	size_t Removed;
+	int Stale; /* Rebuilt by the next get or put */
+} SymBloom;
+
+/**
+ * Chunk of nodes copied by `symtab_compact`, the nodes follow the header.
+ * Chunks are aligned to their size, so the chunk of a node is found from
+ * its address. `Live` is the number of nodes in the chunk, plus one while
+ * the table still copies nodes into it; the chunk is freed at zero.
+ * The chunks of a table with huge pages are `Size` bytes large, mapped
+ * (`Mapped`) unless that failed, and their nodes have the flag `NODE_HUGE`.
+ */
+typedef struct
+{
+	size_t Live;
+	size_t Used;
+	size_t Size;
+	int Mapped;
+	unsigned long Pass;
+} SymArena;
+
+/* Hot cache: number of sets of two slots, longest key + 1 */
+#define HOT_SETS 256
+#define HOT_KEY  24
+
+/* Symbol found by a recent lookup, the slot is empty if `Value` is 0 */
+typedef struct
+{
+	uint32_t Tag;
+	int Value;
+	char Key[HOT_KEY];
+} SymHotSlot;
+
+/**
+ * Two-way set associative cache of recently found symbols, checked by
+ * `symtab_get` before the tree. The low bits of a key's hash select a set
+ * (one cache line), the high bits are the tag. Keys are stored as in the
+ * tree, so encoded or folded. `Sets[i][0]` is the more recently used slot.
+ */
+typedef struct
+{
+	SymHotSlot Sets[HOT_SETS][2];
+	unsigned long Hits;
+	unsigned long Misses;
+} SymHot;
+
+/* Label compression: byte values of the dictionary codes */
+#define DICT_FIRST  0x80
+#define DICT_ESCAPE 0xFF
+#define DICT_WORDS  (DICT_ESCAPE - DICT_FIRST)
+#define DICT_MAX    8
+
+/**
+ * Dictionary of frequent substrings of a compressed table. Keys are
+ * encoded by replacing the longest word at each position with its code,
+ * other bytes from `DICT_FIRST` up are escaped with `DICT_ESCAPE`.
+ * `First[c]` is the longest word starting with the byte c (+1, 0 if there
+ * is none), `Next[i]` the next shorter one (+1).
+ */
+typedef struct
+{
+	char Words[DICT_WORDS][DICT_MAX];
+	unsigned char Length[DICT_WORDS];
+	unsigned char First[256];
+	unsigned char Next[DICT_WORDS];
+} SymDict;
+
+/* Symbol stored in a slot of a perfect hash index */
+typedef struct
+{
+	const char *Key;
+	int Value;
+} SymHashSlot;
+
+/**
+ * Minimal perfect hash index of a frozen table (hash and displace):
+ * the upper half of a key's hash selects a bucket, and the seed of that
+ * bucket selects the slot, so an exact lookup is a single comparison
+ */
+typedef struct
+{
+	const uint32_t *Seeds;
+	const SymHashSlot *Slots;
+	uint32_t Buckets;
+	uint32_t Size;
+} SymHash;
+
+/**
+ * `Count` and `Bytes` track the number of symbols and the memory used by
+ * the nodes. A cache table evicts symbols when it exceeds `MaxKeys` or
+ * `MaxBytes`, `Hand` is the key where the CLOCK sweep stopped last time.
+ *
+ * A frozen table never changes: the nodes of a table made by
+ * `symtab_freeze` are in one allocation (`Block`), those of a generated
+ * table are static data and `Block` is NULL. `Mapped` and `HashMapped`
+ * are the sizes of the mappings if `Block` and `Hash` are in huge pages,
+ * 0 if they are from malloc.
+ *
+ * The labels of a table with a `Dict` are compressed, all keys used inside
+ * the tree (and by the bloom filter, hash index and clock hand) are encoded.
+ *
+ * `Fold` maps every byte of a key to its folded form, the labels of a
+ * table with folding are stored folded.
+ *
+ * `symtab_compact` copies the nodes in pre-order into `Arena` chunks.
+ * `Compact` is the key of the last node it copied during the current
+ * `Pass`, or NULL if no pass is running. With `Huge`, the chunks and
+ * the block of a frozen copy are taken from huge pages.
+ */
+struct SYMTAB
+{
+	SymNode *Root;
+	SymWal *Wal;
+	int ReadOnly;
+	int Shared;
+	int Frozen;
+	size_t Count;
+	size_t Bytes;
+	size_t MaxKeys;
+	size_t MaxBytes;
+	char *Hand;
+	unsigned long Hits;
+	unsigned long Misses;
+	unsigned long Evictions;
+	SymBloom *Bloom;
+	SymHot *Hot;
+	SymNode *Dying;
+	void *Block;
+	size_t Mapped;
+	size_t HashMapped;
+	const SymHash *Hash;
+	SymDict *Dict;
+	unsigned char *Fold;
+	SymArena *Arena;
+	char *Compact;
+	unsigned long Pass;
+	int Huge;
+	unsigned long Ops[OP_COUNT];
+	unsigned long Visits[OP_COUNT];
+};
+
+#endif /* __SYMTAB_IMPL_H__ */
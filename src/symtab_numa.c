@@ -0,0 +1,386 @@
+/**
+ * @file    symtab_numa.c
+ * @author  Anton Tchekov
+ * @version 0.1
+ * @date    2023-09-02
+ * @brief   Read replicas of a symbol table, one frozen copy per NUMA node
+ *
+ * Updates go to a master table. Publishing them freezes the master once
+ * for every node, on a thread that may only run on the CPUs of that node,
+ * so the copy is placed in the node's memory when it is first written.
+ *
+ * A reader adds itself to one of the two reader counts of its node (the
+ * one selected by the parity of `Epoch`) before it loads the replica, and
+ * removes itself when it is done. If the parity changed while it was
+ * adding itself, it tries again. Publishing swaps the replicas, flips
+ * the parity, and waits until the old parity is zero on every node before
+ * the old replicas are freed: readers that come later use the new parity
+ * and see the new replicas.
+ */
+
+#define _GNU_SOURCE
+
+#include "symtab.h"
+
+#if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define NUMA_PATH     "/sys/devices/system/node"
+#define NUMA_MAX_CPUS CPU_SETSIZE
+#define NUMA_MAX_LINE 4096
+
+/* Replica of one node, on its own cache lines */
+typedef struct
+{
+	SymTab *Tab;
+	unsigned long Readers[2];
+	cpu_set_t Cpus;
+} __attribute__((aligned(64))) SymReplica;
+
+struct SYMREPLICAS
+{
+	SymTab *Master;
+	SymReplica *Replicas;
+	int Count;
+	int Dirty;
+	unsigned long Epoch;
+	int CpuNode[NUMA_MAX_CPUS];
+	pthread_mutex_t Lock;
+};
+
+/* Frozen copy of the master, made on the replica's node */
+typedef struct
+{
+	const SymTab *Master;
+	SymTab *Copy;
+} SymReplicaBuild;
+
+/* --- PRIVATE --- */
+static int _read_line(const char *path, char *buf, size_t size)
+{
+	FILE *fp = fopen(path, "r");
+	int rv = -1;
+	if(fp)
+	{
+		rv = fgets(buf, size, fp) ? 0 : -1;
+		fclose(fp);
+	}
+
+	return rv;
+}
+
+/* Parses a list like "0-3,8,10-11" into `set`, returns -1 if invalid */
+static int _parse_list(const char *s, unsigned char *set, int max)
+{
+	while(*s && *s != '\n')
+	{
+		char *end;
+		long first = strtol(s, &end, 10), last = first;
+		if(end == s)
+		{
+			return -1;
+		}
+
+		if(*end == '-')
+		{
+			s = end + 1;
+			last = strtol(s, &end, 10);
+			if(end == s)
+			{
+				return -1;
+			}
+		}
+
+		if(first < 0 || last >= max || first > last)
+		{
+			return -1;
+		}
+
+		for(; first <= last; ++first)
+		{
+			set[first] = 1;
+		}
+
+		s = *end == ',' ? end + 1 : end;
+	}
+
+	return 0;
+}
+
+/* One replica per node in sysfs, or 0 if the nodes can't be read */
+static int _detect(SymReplicas *r)
+{
+	unsigned char nodes[NUMA_MAX_CPUS], cpus[NUMA_MAX_CPUS];
+	char buf[NUMA_MAX_LINE], path[64];
+	int node, cpu, count = 0;
+
+	memset(nodes, 0, sizeof(nodes));
+	if(_read_line(NUMA_PATH "/online", buf, sizeof(buf)) ||
+		_parse_list(buf, nodes, NUMA_MAX_CPUS))
+	{
+		return 0;
+	}
+
+	for(node = 0; node < NUMA_MAX_CPUS; ++node)
+	{
+		count += nodes[node];
+	}
+
+	if(!count)
+	{
+		return 0;
+	}
+
+	r->Replicas = aligned_alloc(64, count * sizeof(*r->Replicas));
+	memset(r->Replicas, 0, count * sizeof(*r->Replicas));
+	count = 0;
+	for(node = 0; node < NUMA_MAX_CPUS; ++node)
+	{
+		if(!nodes[node])
+		{
+			continue;
+		}
+
+		/* Nodes with memory but no CPUs get no readers */
+		memset(cpus, 0, sizeof(cpus));
+		sprintf(path, NUMA_PATH "/node%d/cpulist", node);
+		if(!_read_line(path, buf, sizeof(buf)) &&
+			!_parse_list(buf, cpus, NUMA_MAX_CPUS))
+		{
+			for(cpu = 0; cpu < NUMA_MAX_CPUS; ++cpu)
+			{
+				if(cpus[cpu])
+				{
+					r->CpuNode[cpu] = count;
+					CPU_SET(cpu, &r->Replicas[count].Cpus);
+				}
+			}
+		}
+
+		++count;
+	}
+
+	return count;
+}
+
+/* `count` replicas with the online CPUs distributed round-robin */
+static void _assign(SymReplicas *r, int count)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int cpu;
+
+	r->Replicas = aligned_alloc(64, count * sizeof(*r->Replicas));
+	memset(r->Replicas, 0, count * sizeof(*r->Replicas));
+	for(cpu = 0; cpu < cpus && cpu < NUMA_MAX_CPUS; ++cpu)
+	{
+		r->CpuNode[cpu] = cpu % count;
+		CPU_SET(cpu, &r->Replicas[cpu % count].Cpus);
+	}
+}
+
+static void *_build(void *arg)
+{
+	SymReplicaBuild *b = arg;
+	b->Copy = symtab_freeze(b->Master);
+	return NULL;
+}
+
+/* Freezes the master on every node, in parallel */
+static void _build_all(SymReplicas *r, SymReplicaBuild *builds)
+{
+	pthread_t *ids = malloc(r->Count * sizeof(*ids));
+	int *started = calloc(r->Count, sizeof(*started));
+	pthread_attr_t attr;
+	int i;
+
+	for(i = 0; i < r->Count; ++i)
+	{
+		builds[i].Master = r->Master;
+		if(r->Count == 1)
+		{
+			break;
+		}
+
+		pthread_attr_init(&attr);
+		if(CPU_COUNT(&r->Replicas[i].Cpus))
+		{
+			pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t),
+				&r->Replicas[i].Cpus);
+		}
+
+		started[i] = !pthread_create(&ids[i], &attr, _build, &builds[i]);
+		pthread_attr_destroy(&attr);
+	}
+
+	/* Without threads (a single node, or if one can't be started) the
+		copy is made here, and placed wherever this thread runs */
+	for(i = 0; i < r->Count; ++i)
+	{
+		if(started[i])
+		{
+			pthread_join(ids[i], NULL);
+		}
+		else
+		{
+			_build(&builds[i]);
+		}
+	}
+
+	free(started);
+	free(ids);
+}
+
+static SymReplica *_local(SymReplicas *r)
+{
+	int cpu = sched_getcpu();
+	if(cpu < 0 || cpu >= NUMA_MAX_CPUS)
+	{
+		cpu = 0;
+	}
+
+	return &r->Replicas[r->CpuNode[cpu]];
+}
+
+/* --- PUBLIC --- */
+SymReplicas *symtab_replicas_create(SymTab *tab, int nodes)
+{
+	SymReplicas *r = calloc(1, sizeof(*r));
+	SymReplicaBuild *builds;
+	int i;
+
+	r->Master = tab;
+	pthread_mutex_init(&r->Lock, NULL);
+	if(nodes > 0)
+	{
+		_assign(r, nodes);
+		r->Count = nodes;
+	}
+	else if(!(r->Count = _detect(r)))
+	{
+		free(r->Replicas);
+		_assign(r, 1);
+		r->Count = 1;
+	}
+
+	builds = malloc(r->Count * sizeof(*builds));
+	_build_all(r, builds);
+	for(i = 0; i < r->Count; ++i)
+	{
+		r->Replicas[i].Tab = builds[i].Copy;
+	}
+
+	free(builds);
+	return r;
+}
+
+int symtab_replicas_count(const SymReplicas *r)
+{
+	return r->Count;
+}
+
+int symtab_replicas_get(SymReplicas *r, const char *ident)
+{
+	SymReplica *rep = _local(r);
+	int parity, value;
+
+	/* If a publish flipped the parity before the reader registered, the
+		next publish would not wait for it: register again */
+	for(;;)
+	{
+		parity = __atomic_load_n(&r->Epoch, __ATOMIC_SEQ_CST) & 1;
+		__atomic_add_fetch(&rep->Readers[parity], 1, __ATOMIC_SEQ_CST);
+		if((int)(__atomic_load_n(&r->Epoch, __ATOMIC_SEQ_CST) & 1) == parity)
+		{
+			break;
+		}
+
+		__atomic_sub_fetch(&rep->Readers[parity], 1, __ATOMIC_RELEASE);
+	}
+
+	value = symtab_get(__atomic_load_n(&rep->Tab, __ATOMIC_SEQ_CST), ident);
+	__atomic_sub_fetch(&rep->Readers[parity], 1, __ATOMIC_RELEASE);
+	return value;
+}
+
+int symtab_replicas_put(SymReplicas *r, const char *ident, int value)
+{
+	int prev;
+	pthread_mutex_lock(&r->Lock);
+	prev = symtab_put(r->Master, ident, value);
+	r->Dirty = 1;
+	pthread_mutex_unlock(&r->Lock);
+	return prev;
+}
+
+int symtab_replicas_remove(SymReplicas *r, const char *ident)
+{
+	int prev;
+	pthread_mutex_lock(&r->Lock);
+	prev = symtab_remove(r->Master, ident);
+	r->Dirty |= prev != 0;
+	pthread_mutex_unlock(&r->Lock);
+	return prev;
+}
+
+void symtab_replicas_publish(SymReplicas *r)
+{
+	SymReplicaBuild *builds;
+	unsigned long epoch;
+	int i, parity;
+
+	pthread_mutex_lock(&r->Lock);
+	if(!r->Dirty)
+	{
+		pthread_mutex_unlock(&r->Lock);
+		return;
+	}
+
+	builds = malloc(r->Count * sizeof(*builds));
+	_build_all(r, builds);
+	for(i = 0; i < r->Count; ++i)
+	{
+		builds[i].Copy = __atomic_exchange_n(&r->Replicas[i].Tab,
+			builds[i].Copy, __ATOMIC_SEQ_CST);
+	}
+
+	/* Readers that registered with the old parity may still use the old
+		replicas, the others already see the new ones */
+	epoch = __atomic_add_fetch(&r->Epoch, 1, __ATOMIC_SEQ_CST);
+	parity = (epoch - 1) & 1;
+	for(i = 0; i < r->Count; ++i)
+	{
+		while(__atomic_load_n(&r->Replicas[i].Readers[parity],
+			__ATOMIC_ACQUIRE))
+		{
+			sched_yield();
+		}
+
+		symtab_destroy(builds[i].Copy);
+	}
+
+	free(builds);
+	r->Dirty = 0;
+	pthread_mutex_unlock(&r->Lock);
+}
+
+void symtab_replicas_destroy(SymReplicas *r)
+{
+	int i;
+	for(i = 0; i < r->Count; ++i)
+	{
+		symtab_destroy(r->Replicas[i].Tab);
+	}
+
+	symtab_destroy(r->Master);
+	pthread_mutex_destroy(&r->Lock);
+	free(r->Replicas);
+	free(r);
+}
+
+#endif
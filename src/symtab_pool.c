@@ -0,0 +1,152 @@
+/**
+ * @file    symtab_pool.c
+ * @author  Anton Tchekov
+ * @version 0.1
+ * @date    2023-09-02
+ * @brief   Work-stealing thread pool for parallel tree operations
+ *
+ * All items are known up front, so a deque is just the range of item
+ * numbers that its thread has not started yet. The owner takes items from
+ * the bottom and thieves from the top, under the deque's lock. When every
+ * deque is empty, no new work can appear and the threads finish.
+ */
+
+#include "symtab_pool.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct
+{
+	pthread_mutex_t Lock;
+	size_t Top;
+	size_t Bottom;
+} PoolDeque;
+
+typedef struct
+{
+	PoolDeque *Deques;
+	int Threads;
+	void *Data;
+	void (*Task)(void *data, size_t item, int worker);
+} Pool;
+
+typedef struct
+{
+	Pool *Pool;
+	int Worker;
+} PoolWorker;
+
+/* --- PRIVATE --- */
+static int _take(PoolDeque *deque, size_t *item, int steal)
+{
+	int found = 0;
+	pthread_mutex_lock(&deque->Lock);
+	if(deque->Top < deque->Bottom)
+	{
+		*item = steal ? deque->Top++ : --deque->Bottom;
+		found = 1;
+	}
+
+	pthread_mutex_unlock(&deque->Lock);
+	return found;
+}
+
+static void *_worker(void *arg)
+{
+	PoolWorker *w = arg;
+	Pool *pool = w->Pool;
+	size_t item = 0;
+	int i;
+
+	for(;;)
+	{
+		if(_take(&pool->Deques[w->Worker], &item, 0))
+		{
+			pool->Task(pool->Data, item, w->Worker);
+			continue;
+		}
+
+		for(i = 1; i < pool->Threads; ++i)
+		{
+			if(_take(&pool->Deques[(w->Worker + i) % pool->Threads],
+				&item, 1))
+			{
+				break;
+			}
+		}
+
+		if(i == pool->Threads)
+		{
+			return NULL;
+		}
+
+		pool->Task(pool->Data, item, w->Worker);
+	}
+}
+
+/* --- PUBLIC --- */
+int pool_threads(int threads)
+{
+	if(threads <= 0)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? (int)cpus : 1;
+	}
+
+	return threads;
+}
+
+void pool_run(size_t count, int threads, void *data,
+	void (*task)(void *data, size_t item, int worker))
+{
+	Pool pool;
+	PoolWorker *workers;
+	pthread_t *ids;
+	int i, started;
+
+	if(threads < 1)
+	{
+		threads = 1;
+	}
+
+	pool.Deques = malloc(threads * sizeof(*pool.Deques));
+	pool.Threads = threads;
+	pool.Data = data;
+	pool.Task = task;
+	workers = malloc(threads * sizeof(*workers));
+	ids = malloc(threads * sizeof(*ids));
+	for(i = 0; i < threads; ++i)
+	{
+		pthread_mutex_init(&pool.Deques[i].Lock, NULL);
+		pool.Deques[i].Top = count * i / threads;
+		pool.Deques[i].Bottom = count * (i + 1) / threads;
+		workers[i].Pool = &pool;
+		workers[i].Worker = i;
+	}
+
+	/* If a thread can't be started, the others steal its items */
+	for(started = 1; started < threads; ++started)
+	{
+		if(pthread_create(&ids[started], NULL, _worker, &workers[started]))
+		{
+			break;
+		}
+	}
+
+	_worker(&workers[0]);
+	for(i = 1; i < started; ++i)
+	{
+		pthread_join(ids[i], NULL);
+	}
+
+	for(i = 0; i < threads; ++i)
+	{
+		pthread_mutex_destroy(&pool.Deques[i].Lock);
+	}
+
+	free(ids);
+	free(workers);
+	free(pool.Deques);
+}
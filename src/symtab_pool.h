@@ -0,0 +1,39 @@
+/**
+ * @file    symtab_pool.h
+ * @author  Anton Tchekov
+ * @version 0.1
+ * @date    2023-09-02
+ * @brief   Work-stealing thread pool for parallel tree operations
+ */
+
+#ifndef __SYMTAB_POOL_H__
+#define __SYMTAB_POOL_H__
+
+#include <stddef.h>
+
+/**
+ * @brief Number of threads to use for a parallel operation
+ *
+ * @param threads Requested number of threads, 0 for one per online CPU
+ * @return Number of threads, at least 1
+ */
+int pool_threads(int threads);
+
+/**
+ * @brief Runs `task` for the items 0 to `count - 1` on `threads` threads,
+ *        one of which is the calling thread. Every thread starts with an
+ *        equal range of items in its own deque and takes them from the
+ *        bottom; a thread whose deque is empty steals from the top of the
+ *        others, so a thread with cheap items helps with the expensive
+ *        ones.
+ *
+ * @param count Number of items
+ * @param threads Number of threads
+ * @param data Pointer to custom data that is passed to `task`
+ * @param task Function that is called once for every item, with the
+ *             number of the thread (0 to `threads - 1`) that runs it
+ */
+void pool_run(size_t count, int threads, void *data,
+	void (*task)(void *data, size_t item, int worker));
+
+#endif /* __SYMTAB_POOL_H__ */
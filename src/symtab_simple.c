@@ -171,6 +171,68 @@ int symtab_get(const SymTab *tab, const char *ident)
 	return value;
 }
 
+int symtab_longest_prefix(const SymTab *tab, const char *ident,
+	size_t *matched_len)
+{
+	int i = 0;
+	int checked = 0;
+	int value = 0;
+	size_t len = 0;
+	int count = tab->Count;
+	int capacity = tab->Capacity;
+
+	while((i < capacity) && (checked < count))
+	{
+		Node *node = tab->Buffer + i;
+		if(node->Value)
+		{
+			size_t node_len = strlen(node->Identifer);
+			if(node_len >= len && !strncmp(node->Identifer, ident, node_len))
+			{
+				value = node->Value;
+				len = node_len;
+			}
+
+			++checked;
+		}
+
+		++i;
+	}
+
+	if(matched_len)
+	{
+		*matched_len = len;
+	}
+
+	return value;
+}
+
+int symtab_scan(const SymTab *tab, const char *text, size_t len, void *data,
+	void (*callback)(void *data, size_t offset, size_t len, int value))
+{
+	size_t pos;
+	int results = 0;
+	int capacity = tab->Capacity;
+
+	for(pos = 0; pos < len; ++pos)
+	{
+		int i;
+		for(i = 0; i < capacity; ++i)
+		{
+			Node *node = tab->Buffer + i;
+			size_t node_len = strlen(node->Identifer);
+			if(node->Value && node_len <= len - pos &&
+				!memcmp(node->Identifer, text + pos, node_len))
+			{
+				callback(data, pos, node_len, node->Value);
+				++results;
+			}
+		}
+	}
+
+	return results;
+}
+
 int symtab_complete(const SymTab *tab, char *ident)
 {
 #if 0
@@ -0,0 +1,413 @@
+/**
+ * @file    symtab_wal.c
+ * @author  Anton Tchekov
+ * @version 0.1
+ * @date    2023-09-02
+ * @brief   Write-ahead log and checkpoint files for durable symbol tables
+ *
+ * Both files consist of the same records:
+ *
+ *   - Key length (varint, 7 bits per byte)
+ *   - Value (32-bit little endian, 0 for removals)
+ *   - Key bytes
+ *   - FNV-1a checksum of all of the above (32-bit little endian)
+ *
+ * The log only grows by appending, so after a crash it is valid up to the
+ * first record with a wrong checksum or missing bytes.
+ */
+
+#include "symtab_wal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define WAL_BUFFER_SIZE (64 * 1024)
+#define WAL_RECORD_MAX  13
+
+struct SYMWAL
+{
+	int Fd;
+	int ImageFd;
+	int SyncEvery;
+	int Pending;
+	int Error;
+	char *Path;
+	unsigned char *Buffer;
+	size_t Length;
+	size_t Capacity;
+};
+
+/* --- PRIVATE --- */
+static uint32_t _checksum(const unsigned char *p, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	while(len--)
+	{
+		hash ^= *p++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static void _put_u32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t _get_u32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static char *_file_name(const char *path, const char *ext)
+{
+	size_t len = strlen(path);
+	size_t ext_len = strlen(ext);
+	char *name = malloc(len + ext_len + 1);
+	memcpy(name, path, len);
+	memcpy(name + len, ext, ext_len + 1);
+	return name;
+}
+
+static int _write_all(int fd, const unsigned char *p, size_t len)
+{
+	while(len)
+	{
+		ssize_t n = write(fd, p, len);
+		if(n < 0)
+		{
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int _sync_dir(const char *path)
+{
+	int fd, rv;
+	const char *slash = strrchr(path, '/');
+	char *dir;
+	if(!slash)
+	{
+		dir = _file_name(".", "");
+	}
+	else
+	{
+		size_t len = slash - path + 1;
+		dir = malloc(len + 1);
+		memcpy(dir, path, len);
+		dir[len] = '\0';
+	}
+
+	fd = open(dir, O_RDONLY);
+	free(dir);
+	if(fd < 0)
+	{
+		return -1;
+	}
+
+	rv = fsync(fd);
+	close(fd);
+	return rv;
+}
+
+/* After a failed write nothing more is written, later records would
+	follow a hole in the file and be replayed without the lost ones */
+static int _flush(SymWal *wal, int fd)
+{
+	if(!wal->Error && wal->Length &&
+		_write_all(fd, wal->Buffer, wal->Length))
+	{
+		wal->Error = 1;
+	}
+
+	wal->Length = 0;
+	return -wal->Error;
+}
+
+static int _record(SymWal *wal, int fd, const char *ident, int value)
+{
+	size_t len = strlen(ident);
+	size_t size = len + WAL_RECORD_MAX;
+	size_t n = len;
+	unsigned char *start, *p;
+
+	if(wal->Error)
+	{
+		return -1;
+	}
+
+	if(wal->Length + size > wal->Capacity)
+	{
+		if(_flush(wal, fd))
+		{
+			return -1;
+		}
+
+		if(size > wal->Capacity)
+		{
+			wal->Capacity = size;
+			wal->Buffer = realloc(wal->Buffer, size);
+		}
+	}
+
+	start = p = wal->Buffer + wal->Length;
+	do
+	{
+		*p++ = (n & 0x7F) | (n > 0x7F ? 0x80 : 0);
+		n >>= 7;
+	}
+	while(n);
+
+	_put_u32(p, value);
+	p += 4;
+	memcpy(p, ident, len);
+	p += len;
+	_put_u32(p, _checksum(start, p - start));
+	p += 4;
+	wal->Length += p - start;
+	return 0;
+}
+
+/* Applies the records of a file up to the first bad one. `valid` is the
+	size of the good records; with `strict`, a bad record is an error. */
+static int _replay_file(const char *name, void *data,
+	void (*apply)(void *data, const char *ident, int value), size_t *valid,
+	int strict)
+{
+	struct stat st;
+	const unsigned char *buf, *p, *end;
+	char *ident = NULL;
+	size_t ident_cap = 0;
+	int fd = open(name, O_RDONLY);
+
+	*valid = 0;
+	if(fd < 0)
+	{
+		return 0;
+	}
+
+	if(fstat(fd, &st))
+	{
+		close(fd);
+		return -1;
+	}
+
+	if(!st.st_size)
+	{
+		close(fd);
+		return 0;
+	}
+
+	/* Mapped, a single read stops at about 2 GiB */
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(buf == MAP_FAILED)
+	{
+		return -1;
+	}
+
+	p = buf;
+	end = buf + st.st_size;
+	while(p < end)
+	{
+		const unsigned char *start = p;
+		size_t len = 0;
+		int shift = 0;
+		while(p < end && (*p & 0x80) && shift < 35)
+		{
+			len |= (size_t)(*p++ & 0x7F) << shift;
+			shift += 7;
+		}
+
+		if(p >= end || shift >= 35)
+		{
+			break;
+		}
+
+		len |= (size_t)*p++ << shift;
+		if((size_t)(end - p) < len + 8)
+		{
+			break;
+		}
+
+		if(_get_u32(p + 4 + len) != _checksum(start, p + 4 + len - start))
+		{
+			break;
+		}
+
+		if(len + 1 > ident_cap)
+		{
+			ident_cap = len + 1;
+			ident = realloc(ident, ident_cap);
+		}
+
+		memcpy(ident, p + 4, len);
+		ident[len] = '\0';
+		apply(data, ident, (int)_get_u32(p));
+		p += len + 8;
+		*valid = p - buf;
+	}
+
+	free(ident);
+	munmap((void *)buf, st.st_size);
+	return strict && *valid != (size_t)st.st_size ? -1 : 0;
+}
+
+/* --- PUBLIC --- */
+int wal_replay(const char *path, void *data,
+	void (*apply)(void *data, const char *ident, int value))
+{
+	size_t valid;
+	int rv;
+	char *name = _file_name(path, ".img");
+
+	/* The image is renamed into place when complete, a bad record means
+		it is corrupt. Only the log can have a torn tail. */
+	rv = _replay_file(name, data, apply, &valid, 1);
+	free(name);
+	if(rv)
+	{
+		return rv;
+	}
+
+	name = _file_name(path, ".log");
+	rv = _replay_file(name, data, apply, &valid, 0);
+	if(!rv && !access(name, F_OK))
+	{
+		rv = truncate(name, valid);
+	}
+
+	free(name);
+	return rv;
+}
+
+SymWal *wal_open(const char *path, int sync_every)
+{
+	SymWal *wal;
+	char *name = _file_name(path, ".log");
+	int fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	free(name);
+	if(fd < 0)
+	{
+		return NULL;
+	}
+
+	wal = malloc(sizeof(*wal));
+	wal->Fd = fd;
+	wal->ImageFd = -1;
+	wal->SyncEvery = sync_every;
+	wal->Pending = 0;
+	wal->Error = 0;
+	wal->Path = _file_name(path, "");
+	wal->Capacity = WAL_BUFFER_SIZE;
+	wal->Buffer = malloc(wal->Capacity);
+	wal->Length = 0;
+	return wal;
+}
+
+int wal_append(SymWal *wal, const char *ident, int value)
+{
+	if(_record(wal, wal->Fd, ident, value))
+	{
+		return -1;
+	}
+
+	if(wal->SyncEvery && ++wal->Pending >= wal->SyncEvery)
+	{
+		return wal_sync(wal);
+	}
+
+	return 0;
+}
+
+int wal_sync(SymWal *wal)
+{
+	if(_flush(wal, wal->Fd))
+	{
+		return -1;
+	}
+
+	wal->Pending = 0;
+	if(fdatasync(wal->Fd))
+	{
+		wal->Error = 1;
+	}
+
+	return -wal->Error;
+}
+
+int wal_image_begin(SymWal *wal)
+{
+	char *name;
+	if(wal_sync(wal))
+	{
+		return -1;
+	}
+
+	name = _file_name(wal->Path, ".img.tmp");
+	wal->ImageFd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	free(name);
+	return wal->ImageFd < 0 ? -1 : 0;
+}
+
+int wal_image_put(SymWal *wal, const char *ident, int value)
+{
+	return _record(wal, wal->ImageFd, ident, value);
+}
+
+int wal_image_end(SymWal *wal, int ok)
+{
+	char *tmp = _file_name(wal->Path, ".img.tmp");
+	char *img = _file_name(wal->Path, ".img");
+	int rv = -1;
+
+	ok = ok && !_flush(wal, wal->ImageFd) && !fsync(wal->ImageFd) &&
+		!rename(tmp, img) && !_sync_dir(img);
+
+	/* wal_image_begin synced the log and it wasn't written since, a failed
+		image leaves it as good as it was */
+	wal->Error = 0;
+	wal->Length = 0;
+	if(ok)
+	{
+		/* The new image already contains every logged operation,
+			replaying them again after a crash right here is harmless */
+		wal->Error = ftruncate(wal->Fd, 0) || fdatasync(wal->Fd);
+		rv = -wal->Error;
+	}
+
+	close(wal->ImageFd);
+	wal->ImageFd = -1;
+	if(rv)
+	{
+		unlink(tmp);
+	}
+
+	free(tmp);
+	free(img);
+	return rv;
+}
+
+void wal_close(SymWal *wal)
+{
+	wal_sync(wal);
+	close(wal->Fd);
+	free(wal->Buffer);
+	free(wal->Path);
+	free(wal);
+}
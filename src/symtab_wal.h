@@ -0,0 +1,96 @@
+/**
+ * @file    symtab_wal.h
+ * @author  Anton Tchekov
+ * @version 0.1
+ * @date    2023-09-02
+ * @brief   Write-ahead log and checkpoint files for durable symbol tables
+ */
+
+#ifndef __SYMTAB_WAL_H__
+#define __SYMTAB_WAL_H__
+
+#include <stddef.h>
+
+/* Write-ahead log of a durable symbol table */
+typedef struct SYMWAL SymWal;
+
+/**
+ * @brief Replays the checkpoint image and log of `path`.
+ *        A torn or corrupted record at the end of the log
+ *        (from a crash during a write) is cut off. A bad record
+ *        in the image is an error, the log is not replayed then.
+ *
+ * @param path Path prefix of the `.img` and `.log` files
+ * @param data Pointer to custom data that is passed to the callback
+ * @param apply Callback that is called for every record in order,
+ *              `value` is 0 for removals
+ * @return 0 on success, -1 on error or if the image is corrupt
+ */
+int wal_replay(const char *path, void *data,
+	void (*apply)(void *data, const char *ident, int value));
+
+/**
+ * @brief Opens the log of `path` for appending
+ *
+ * @param path Path prefix of the `.img` and `.log` files
+ * @param sync_every Number of records per fsync, 0 to never fsync
+ *                   until `wal_sync` is called
+ * @return Log or NULL on error
+ */
+SymWal *wal_open(const char *path, int sync_every);
+
+/**
+ * @brief Appends a record to the log. After a failed write, no more
+ *        records are written, so the log never has a gap.
+ *
+ * @param wal Log
+ * @param ident Symbol identifier
+ * @param value New value, 0 for removals
+ * @return 0 on success, -1 if this or any earlier write failed
+ */
+int wal_append(SymWal *wal, const char *ident, int value);
+
+/**
+ * @brief Writes all buffered records and waits until they are on disk
+ *
+ * @param wal Log
+ * @return 0 on success, -1 if this or any earlier write failed
+ */
+int wal_sync(SymWal *wal);
+
+/**
+ * @brief Starts writing a new checkpoint image into a temporary file
+ *
+ * @param wal Log
+ * @return 0 on success, -1 on error
+ */
+int wal_image_begin(SymWal *wal);
+
+/**
+ * @brief Adds a symbol to the checkpoint image
+ *
+ * @param wal Log
+ * @param ident Symbol identifier
+ * @param value Symbol value
+ * @return 0 on success, -1 on error
+ */
+int wal_image_put(SymWal *wal, const char *ident, int value);
+
+/**
+ * @brief Atomically replaces the old checkpoint image with the new one
+ *        and truncates the log. When `ok` is 0, the new image is discarded.
+ *
+ * @param wal Log
+ * @param ok 1 if all symbols were written successfully
+ * @return 0 on success, -1 on error
+ */
+int wal_image_end(SymWal *wal, int ok);
+
+/**
+ * @brief Syncs and closes the log
+ *
+ * @param wal Log
+ */
+void wal_close(SymWal *wal);
+
+#endif /* __SYMTAB_WAL_H__ */
@@ -3,6 +3,12 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include "bench.h"
+#include "trace.h"
 
 #define CAPACITY 1024
 
@@ -74,6 +80,19 @@ static void test_prefix_iter(void)
 
 	symtab_prefix_iter(tab, buf, 3, &cnt, iter_callback);
 	assert(cnt == 3);
+	assert(!strcmp(buf, "sy"));
+
+	cnt = 0;
+	assert(symtab_prefix_iter(tab, buf, 0, &cnt, iter_callback) == 4);
+
+	strcpy(buf, "test_e");
+	assert(symtab_prefix_iter(tab, buf, 0, &cnt, iter_callback) == 1);
+
+	strcpy(buf, "");
+	assert(symtab_prefix_iter(tab, buf, 0, &cnt, iter_callback) == 7);
+
+	strcpy(buf, "symbol");
+	assert(symtab_prefix_iter(tab, buf, 0, &cnt, iter_callback) == 0);
 
 	symtab_destroy(tab);
 }
@@ -121,6 +140,84 @@ static void test_put_get(void)
 	symtab_destroy(tab);
 }
 
+static void test_longest_prefix(void)
+{
+	size_t len;
+	SymTab *tab;
+
+	printf("\ntest_longest_prefix\n");
+
+	tab = symtab_create(CAPACITY);
+
+	symtab_put(tab, "/", 1);
+	symtab_put(tab, "/api/", 2);
+	symtab_put(tab, "/api/users", 3);
+	symtab_put(tab, "/static/", 4);
+
+	/* 10.0.0.0/8 and 10.1.0.0/16 as bit strings */
+	symtab_put(tab, "00001010", 8);
+	symtab_put(tab, "0000101000000001", 16);
+
+	assert(symtab_longest_prefix(tab, "/api/users/17", &len) == 3);
+	assert(len == 10);
+	assert(symtab_longest_prefix(tab, "/api/groups", &len) == 2);
+	assert(len == 5);
+	assert(symtab_longest_prefix(tab, "/apple", &len) == 1);
+	assert(len == 1);
+	assert(symtab_longest_prefix(tab, "/static/", &len) == 4);
+	assert(len == 8);
+	assert(symtab_longest_prefix(tab, "api", &len) == 0);
+	assert(len == 0);
+	assert(symtab_longest_prefix(tab, "", NULL) == 0);
+
+	/* 10.1.2.3 and 10.2.0.1 */
+	assert(symtab_longest_prefix(tab,
+		"00001010000000010000001000000011", &len) == 16);
+	assert(len == 16);
+	assert(symtab_longest_prefix(tab,
+		"00001010000000100000000000000001", &len) == 8);
+	assert(len == 8);
+
+	symtab_destroy(tab);
+}
+
+static void scan_callback(void *data, size_t offset, size_t len, int value)
+{
+	int *sum = data;
+	printf("%zu: %zu bytes = %d\n", offset, len, value);
+	*sum += value * (int)offset;
+}
+
+static void test_scan(void)
+{
+	static const char text[] = "error: the tester failed to test the team";
+	int sum = 0;
+	SymTab *tab;
+
+	printf("\ntest_scan\n");
+
+	tab = symtab_create(CAPACITY);
+
+	symtab_put(tab, "test", 1);
+	symtab_put(tab, "tester", 2);
+	symtab_put(tab, "team", 3);
+	symtab_put(tab, "error", 4);
+	symtab_put(tab, "the", 5);
+	symtab_put(tab, "r", 6);
+
+	/* error(0) r(1) r(2) r(4) the(7) test(11) tester(11) r(16) test(28)
+		the(33) team(37) */
+	assert(symtab_scan(tab, text, sizeof(text) - 1, &sum, scan_callback) == 11);
+	assert(sum == 0 * 4 + 1 * 6 + 2 * 6 + 4 * 6 + 7 * 5 + 11 * 1 + 11 * 2 +
+		16 * 6 + 28 * 1 + 33 * 5 + 37 * 3);
+
+	/* The text does not need to be terminated */
+	assert(symtab_scan(tab, "testing", 3, &sum, scan_callback) == 0);
+	assert(symtab_scan(tab, "", 0, &sum, scan_callback) == 0);
+
+	symtab_destroy(tab);
+}
+
 static void test_remove_prefix(void)
 {
 	SymTab *tab;
@@ -246,101 +343,1355 @@ static void test_remove(void)
 	symtab_destroy(tab);
 }
 
-static void test_cmdline(void)
+#if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
+
+static void test_snapshot(void)
+{
+	SymTab *tab, *snap;
+
+	printf("\ntest_snapshot\n");
+
+	tab = symtab_create(CAPACITY);
+
+	symtab_put(tab, "team", 22);
+	symtab_put(tab, "test", 55);
+	symtab_put(tab, "toast", 44);
+
+	snap = symtab_snapshot(tab);
+
+	symtab_put(tab, "test", 56);
+	symtab_put(tab, "tea", 12);
+	symtab_put(tab, "hello", 1);
+	symtab_remove(tab, "toast");
+	symtab_remove(tab, "team");
+	assert(symtab_remove(tab, "nonexistant") == 0);
+
+	symtab_print(tab);
+	symtab_print(snap);
+
+	assert(symtab_get(tab, "test") == 56);
+	assert(symtab_get(tab, "tea") == 12);
+	assert(symtab_get(tab, "hello") == 1);
+	assert(symtab_get(tab, "toast") == 0);
+	assert(symtab_get(tab, "team") == 0);
+
+	assert(symtab_get(snap, "test") == 55);
+	assert(symtab_get(snap, "tea") == 0);
+	assert(symtab_get(snap, "hello") == 0);
+	assert(symtab_get(snap, "toast") == 44);
+	assert(symtab_get(snap, "team") == 22);
+
+	symtab_destroy(tab);
+	assert(symtab_get(snap, "toast") == 44);
+	symtab_destroy(snap);
+}
+
+static void fuzzy_callback(void *data, const char *ident, int value,
+	int distance)
+{
+	int *n = data;
+	printf("%d: %s = %d (%d edits)\n", *n, ident, value, distance);
+	++(*n);
+}
+
+static void test_fuzzy(void)
+{
+	int cnt = 0;
+	SymTab *tab;
+
+	printf("\ntest_fuzzy\n");
+
+	tab = symtab_create(CAPACITY);
+
+	symtab_put(tab, "main", 1);
+	symtab_put(tab, "test_put", 2);
+	symtab_put(tab, "symtab_create", 3);
+	symtab_put(tab, "symtab_destroy", 4);
+	symtab_put(tab, "symtab_put", 5);
+	symtab_put(tab, "symtab_get", 6);
+	symtab_put(tab, "test_exists", 7);
+
+	assert(symtab_fuzzy(tab, "symtab_gte", 2, 0, &cnt, fuzzy_callback) == 1);
+	assert(cnt == 1);
+
+	/* symtab_put, symtab_get */
+	assert(symtab_fuzzy(tab, "symtab_pet", 1, 0, &cnt, fuzzy_callback) == 2);
+	assert(symtab_fuzzy(tab, "symtab_pet", 1, 1, &cnt, fuzzy_callback) == 1);
+
+	assert(symtab_fuzzy(tab, "mian", 2, 0, &cnt, fuzzy_callback) == 1);
+	assert(symtab_fuzzy(tab, "main", 0, 0, &cnt, fuzzy_callback) == 1);
+	assert(symtab_fuzzy(tab, "nothing", 2, 0, &cnt, fuzzy_callback) == 0);
+	assert(symtab_fuzzy(tab, "", 4, 0, &cnt, fuzzy_callback) == 1);
+	assert(cnt == 7);
+
+	symtab_destroy(tab);
+}
+
+static void match_callback(void *data, const char *ident, int value)
+{
+	int *n = data;
+	printf("%d: %s = %d\n", *n, ident, value);
+	++(*n);
+}
+
+static void test_match(void)
+{
+	int cnt = 0;
+	SymTab *tab;
+
+	printf("\ntest_match\n");
+
+	tab = symtab_create(CAPACITY);
+
+	symtab_put(tab, "net.eth0.rx_bytes", 1);
+	symtab_put(tab, "net.eth0.rx_packets", 2);
+	symtab_put(tab, "net.eth0.tx_bytes", 3);
+	symtab_put(tab, "net.eth1.rx_bytes", 4);
+	symtab_put(tab, "net.lo.rx_bytes", 5);
+	symtab_put(tab, "net", 6);
+	symtab_put(tab, "mem.free", 7);
+
+	assert(symtab_match(tab, "net.*.rx_*", &cnt, match_callback) == 4);
+	assert(symtab_match(tab, "net.eth?.rx_bytes", &cnt, match_callback) == 2);
+	assert(symtab_match(tab, "net.eth[!0].*", &cnt, match_callback) == 1);
+	assert(symtab_match(tab, "net.[a-z][a-z].*", &cnt, match_callback) == 1);
+	assert(symtab_match(tab, "*", &cnt, match_callback) == 7);
+	assert(symtab_match(tab, "net", &cnt, match_callback) == 1);
+	assert(symtab_match(tab, "*.free", &cnt, match_callback) == 1);
+	assert(symtab_match(tab, "net.\\*", &cnt, match_callback) == 0);
+	assert(symtab_match(tab, "disk.*", &cnt, match_callback) == 0);
+	assert(symtab_match(tab, "net.[abc", &cnt, match_callback) == -1);
+	assert(cnt == 17);
+
+	symtab_destroy(tab);
+}
+
+static void test_cache(void)
+{
+	int i;
+	char buf[32];
+	SymCacheStats stats;
+	SymTab *tab;
+
+	printf("\ntest_cache\n");
+
+	tab = symtab_create_cache(4, 0);
+
+	symtab_put(tab, "alpha", 1);
+	symtab_put(tab, "beta", 2);
+	symtab_put(tab, "gamma", 3);
+	symtab_put(tab, "delta", 4);
+
+	/* The first sweep clears all reference bits, then evicts alpha */
+	symtab_put(tab, "epsilon", 5);
+	assert(symtab_get(tab, "alpha") == 0);
+
+	/* beta gets a second chance */
+	assert(symtab_get(tab, "beta") == 2);
+	symtab_put(tab, "zeta", 6);
+
+	symtab_print(tab);
+
+	assert(symtab_get(tab, "gamma") == 0);
+	assert(symtab_get(tab, "beta") == 2);
+	assert(symtab_get(tab, "delta") == 4);
+	assert(symtab_get(tab, "epsilon") == 5);
+	assert(symtab_get(tab, "zeta") == 6);
+
+	symtab_cache_stats(tab, &stats);
+	assert(stats.Evictions == 2);
+	assert(stats.Keys == 4);
+	assert(stats.Hits == 5);
+	assert(stats.Misses == 2);
+
+	symtab_destroy(tab);
+
+	/* Memory budget */
+	tab = symtab_create_cache(0, 2000);
+	for(i = 0; i < 200; ++i)
+	{
+		sprintf(buf, "key_%d", i);
+		symtab_put(tab, buf, i + 1);
+		symtab_cache_stats(tab, &stats);
+		assert(stats.Bytes <= 2000);
+	}
+
+	assert(symtab_get(tab, "key_199") == 200);
+	assert(stats.Evictions > 0);
+	assert(stats.Keys + stats.Evictions == 200);
+	symtab_destroy(tab);
+}
+
+static void test_hot_cache(void)
+{
+	int i;
+	char buf[40];
+	unsigned long hits, misses;
+	SymHotStats stats;
+	SymTab *tab;
+
+	printf("\ntest_hot_cache\n");
+
+	tab = symtab_create(CAPACITY);
+	symtab_hot_cache(tab);
+	for(i = 0; i < 100; ++i)
+	{
+		sprintf(buf, "key_%d", i);
+		symtab_put(tab, buf, i + 1);
+	}
+
+	/* The first get of a key walks the tree, the second one doesn't */
+	for(i = 0; i < 200; ++i)
+	{
+		sprintf(buf, "key_%d", i / 2);
+		assert(symtab_get(tab, buf) == i / 2 + 1);
+	}
+
+	symtab_hot_stats(tab, &stats);
+	assert(stats.Misses == 100);
+	assert(stats.Hits == 100);
+
+	/* Puts and removes of cached keys */
+	assert(symtab_get(tab, "key_5") == 6);
+	assert(symtab_get(tab, "key_7") == 8);
+	symtab_put(tab, "key_5", 0x1234);
+	symtab_hot_stats(tab, &stats);
+	hits = stats.Hits;
+	assert(symtab_get(tab, "key_5") == 0x1234);
+	assert(symtab_remove(tab, "key_7") == 8);
+	assert(symtab_get(tab, "key_7") == 0);
+	symtab_put(tab, "key_7", 7);
+	assert(symtab_get(tab, "key_7") == 7);
+	symtab_hot_stats(tab, &stats);
+	assert(stats.Hits == hits + 1);
+
+	/* Long keys are never cached */
+	misses = stats.Misses;
+	symtab_put(tab, "a_key_that_is_too_long_to_cache", 9);
+	assert(symtab_get(tab, "a_key_that_is_too_long_to_cache") == 9);
+	assert(symtab_get(tab, "a_key_that_is_too_long_to_cache") == 9);
+	symtab_hot_stats(tab, &stats);
+	assert(stats.Hits == hits + 1);
+	assert(stats.Misses == misses + 2);
+	symtab_destroy(tab);
+
+	/* Keys are cached folded */
+	tab = symtab_create(CAPACITY);
+	symtab_fold(tab, NULL);
+	symtab_hot_cache(tab);
+	symtab_put(tab, "Alpha", 1);
+	assert(symtab_get(tab, "ALPHA") == 1);
+	symtab_put(tab, "alpha", 2);
+	assert(symtab_get(tab, "aLpHa") == 2);
+	symtab_remove(tab, "ALPHA");
+	assert(symtab_get(tab, "alpha") == 0);
+	symtab_hot_stats(tab, &stats);
+	assert(stats.Hits == 1);
+	symtab_destroy(tab);
+
+	/* Lookups that hit the cache don't set the reference bit, being
+		cached gives a second chance instead */
+	tab = symtab_create_cache(2, 0);
+	symtab_hot_cache(tab);
+	symtab_put(tab, "alpha", 1);
+	symtab_put(tab, "beta", 2);
+	assert(symtab_get(tab, "alpha") == 1);
+	symtab_put(tab, "gamma", 3);
+	assert(symtab_get(tab, "beta") == 0);
+	assert(symtab_get(tab, "alpha") == 1);
+	symtab_put(tab, "delta", 4);
+	assert(symtab_get(tab, "alpha") == 1);
+	assert(symtab_get(tab, "gamma") == 0);
+	assert(symtab_get(tab, "delta") == 4);
+	symtab_hot_stats(tab, &stats);
+	assert(stats.Hits == 1);
+	symtab_destroy(tab);
+}
+
+static void test_stats(void)
+{
+	int i;
+	SymStats stats;
+	SymTab *tab;
+
+	printf("\ntest_stats\n");
+
+	tab = symtab_create(CAPACITY);
+
+	symtab_put(tab, "hello", 7);
+	symtab_put(tab, "world", 2);
+	symtab_put(tab, "test", 5);
+	symtab_put(tab, "team", 9);
+	symtab_put(tab, "toast", 4);
+	symtab_put(tab, "te", 11);
+	symtab_put(tab, "browser", 42);
+	symtab_put(tab, "brow", 9);
+	symtab_get(tab, "toast");
+	symtab_get(tab, "nonexistant");
+	symtab_remove(tab, "world");
+
+	symtab_stats(tab, &stats);
+	printf("nodes %zu, leaves %zu, label bytes %zu, node bytes %zu, "
+		"allocator overhead %zu\n", stats.Nodes, stats.Leaves,
+		stats.LabelBytes, stats.NodeBytes, stats.AllocatorBytes);
+
+	/* root, hello, t, e, st, am, oast, brow, ser */
+	assert(stats.Nodes == 9);
+	assert(stats.Leaves == 7);
+	assert(stats.LabelBytes == 22);
+	assert(stats.Depth[1] == 2);
+	assert(stats.Depth[2] == 3);
+	assert(stats.Depth[3] == 2);
+	assert(stats.Siblings[0] == 1);
+	assert(stats.Siblings[1] == 3);
+
+	for(i = 0; i < SYMTAB_HISTOGRAM; ++i)
+	{
+		printf("%d: %zu symbols, %zu sibling lists\n", i,
+			stats.Depth[i], stats.Siblings[i]);
+	}
+
+#ifdef SYMTAB_STATS
+	printf("%.2f nodes per get, %.2f per put, %.2f per remove\n",
+		stats.GetVisits, stats.PutVisits, stats.RemoveVisits);
+	assert(stats.Gets == 2);
+	assert(stats.Puts == 8);
+	assert(stats.Removes == 1);
+	assert(stats.GetVisits > 1.0);
+#endif
+
+	symtab_destroy(tab);
+}
+
+static void test_bloom(void)
+{
+	int i;
+	char buf[32];
+	SymTab *tab;
+#ifdef SYMTAB_STATS
+	SymStats stats;
+#endif
+
+	printf("\ntest_bloom\n");
+
+	tab = symtab_create(CAPACITY);
+	symtab_put(tab, "before", 1);
+	symtab_bloom(tab);
+
+	/* Grows past the planned size several times */
+	for(i = 0; i < 1000; ++i)
+	{
+		sprintf(buf, "key_%d", i);
+		symtab_put(tab, buf, i + 1);
+	}
+
+	for(i = 0; i < 1000; ++i)
+	{
+		sprintf(buf, "key_%d", i);
+		assert(symtab_get(tab, buf) == i + 1);
+		sprintf(buf, "miss_%d", i);
+		assert(symtab_get(tab, buf) == 0);
+	}
+
+	assert(symtab_get(tab, "before") == 1);
+
+	for(i = 0; i < 1000; i += 2)
+	{
+		sprintf(buf, "key_%d", i);
+		assert(symtab_remove(tab, buf) == i + 1);
+	}
+
+	for(i = 0; i < 1000; ++i)
+	{
+		sprintf(buf, "key_%d", i);
+		assert(symtab_get(tab, buf) == (i & 1 ? i + 1 : 0));
+	}
+
+	symtab_destroy(tab);
+
+#ifdef SYMTAB_STATS
+	/* Misses should mostly not touch the tree */
+	tab = symtab_create(CAPACITY);
+	symtab_bloom(tab);
+	for(i = 0; i < 1000; ++i)
+	{
+		sprintf(buf, "key_%d", i);
+		symtab_put(tab, buf, i + 1);
+	}
+
+	for(i = 0; i < 1000; ++i)
+	{
+		sprintf(buf, "miss_%d", i);
+		symtab_get(tab, buf);
+	}
+
+	symtab_stats(tab, &stats);
+	printf("%.3f nodes per missing get\n", stats.GetVisits);
+	assert(stats.GetVisits < 0.2);
+
+	/* Removed symbols leave the filter before the next lookup */
+	for(i = 0; i < 1000; ++i)
+	{
+		sprintf(buf, "key_%d", i);
+		symtab_remove(tab, buf);
+	}
+
+	for(i = 0; i < 1000; ++i)
+	{
+		sprintf(buf, "key_%d", i);
+		assert(symtab_get(tab, buf) == 0);
+	}
+
+	symtab_stats(tab, &stats);
+	printf("%.3f nodes per get after removes\n", stats.GetVisits);
+	assert(stats.GetVisits < 0.2);
+	symtab_destroy(tab);
+#endif
+}
+
+static void test_freeze(void)
+{
+	int i;
+	char buf[32];
+	SymTab *tab, *frozen;
+	SymStats stats;
+
+	printf("\ntest_freeze\n");
+
+	tab = symtab_create(CAPACITY);
+	for(i = 0; i < 1000; ++i)
+	{
+		sprintf(buf, "key_%d", i);
+		symtab_put(tab, buf, i + 1);
+	}
+
+	symtab_put(tab, "ke", 5000);
+	frozen = symtab_freeze(tab);
+	symtab_destroy(tab);
+
+	for(i = 0; i < 1000; ++i)
+	{
+		sprintf(buf, "key_%d", i);
+		assert(symtab_get(frozen, buf) == i + 1);
+		sprintf(buf, "key_%dx", i);
+		assert(symtab_get(frozen, buf) == 0);
+	}
+
+	assert(symtab_get(frozen, "ke") == 5000);
+	assert(symtab_get(frozen, "k") == 0);
+	assert(symtab_get(frozen, "") == 0);
+
+	strcpy(buf, "key_99");
+	assert(symtab_complete(frozen, buf) == 0);
+	strcpy(buf, "k");
+	assert(symtab_complete(frozen, buf) == 1);
+	assert(!strcmp(buf, "ke"));
+
+	symtab_stats(frozen, &stats);
+	assert(stats.Leaves == 1001);
+	assert(stats.AllocatorBytes < 8 * stats.Nodes);
+	symtab_destroy(frozen);
+
+	/* Empty tables have no hash index */
+	tab = symtab_create(CAPACITY);
+	frozen = symtab_freeze(tab);
+	assert(symtab_get(frozen, "key") == 0);
+	symtab_destroy(frozen);
+	symtab_destroy(tab);
+}
+
+static void fold_callback(void *data, int worker, const char *ident,
+	int value)
+{
+	assert(!strcmp(ident, value == 1 ? "symtab_create" : "symtab_destroy"));
+	++*(int *)data;
+	(void)worker;
+}
+
+static void test_fold(void)
+{
+	unsigned char map[256];
+	char buf[32];
+	size_t len;
+	int i, n;
+	SymTab *tab, *frozen;
+
+	printf("\ntest_fold\n");
+
+	tab = symtab_create(CAPACITY);
+	assert(symtab_fold(tab, NULL) == 0);
+	assert(symtab_fold(tab, NULL) == -1);
+	assert(symtab_compress(tab, NULL, 0) == -1);
+	assert(symtab_put(tab, "Symtab_Create", 1) == 0);
+	assert(symtab_put(tab, "SYMTAB_DESTROY", 2) == 0);
+	assert(symtab_put(tab, "symtab_create", 3) == 1);
+	assert(symtab_get(tab, "SymTab_Create") == 3);
+	assert(symtab_get(tab, "symtab_destroy") == 2);
+	assert(symtab_get(tab, "symtab_destroyed") == 0);
+	assert(symtab_longest_prefix(tab, "SYMTAB_CREATE()", &len) == 3);
+	assert(len == 13);
+	symtab_put(tab, "symtab_create", 1);
+
+	strcpy(buf, "SymTab_C");
+	assert(symtab_complete(tab, buf) == 1);
+	assert(!strcmp(buf, "SymTab_Create"));
+	strcpy(buf, "SYM");
+	n = 0;
+	assert(symtab_prefix_iter(tab, buf, 0, &n, iter_callback) == 2);
+	assert(!strcmp(buf, "sym"));
+	n = 0;
+	assert(symtab_prefix_iter_parallel(tab, "SYMTAB_", 2, &n,
+		fold_callback) == 2);
+	assert(n == 2);
+
+	symtab_bloom(tab);
+	assert(symtab_get(tab, "SYMTAB_CREATE") == 1);
+	frozen = symtab_freeze(tab);
+	assert(symtab_get(frozen, "SYMTAB_CREATE") == 1);
+	assert(symtab_get(frozen, "SYMTAB_CREATE_") == 0);
+	symtab_destroy(frozen);
+
+	assert(symtab_remove(tab, "SYMTAB_create") == 1);
+	assert(symtab_get(tab, "symtab_create") == 0);
+	assert(symtab_fold(tab, NULL) == -1);
+	symtab_destroy(tab);
+
+	/* Custom mapping: case and '-' versus '_' don't matter */
+	for(i = 0; i < 256; ++i)
+	{
+		map[i] = i >= 'a' && i <= 'z' ? i - 32 : i;
+	}
+
+	map['-'] = '_';
+	tab = symtab_create(CAPACITY);
+	assert(symtab_fold(tab, map) == 0);
+	symtab_put(tab, "max-line-length", 80);
+	assert(symtab_get(tab, "MAX_LINE_LENGTH") == 80);
+	assert(symtab_get(tab, "Max_Line-Length") == 80);
+	symtab_destroy(tab);
+
+	/* Mappings that change folded keys again are rejected */
+	tab = symtab_create(CAPACITY);
+	map['_'] = '-';
+	assert(symtab_fold(tab, map) == -1);
+	map['_'] = '_';
+	map[0] = '_';
+	assert(symtab_fold(tab, map) == -1);
+	symtab_destroy(tab);
+}
+
+static void test_compact(void)
+{
+	int i, steps = 0;
+	char buf[32];
+	SymTab *tab, *snap;
+	SymStats stats;
+
+	printf("\ntest_compact\n");
+
+	tab = symtab_create(CAPACITY);
+	for(i = 0; i < 2000; ++i)
+	{
+		sprintf(buf, "key_%d", i);
+		symtab_put(tab, buf, i + 1);
+	}
+
+	for(i = 1; i < 2000; i += 2)
+	{
+		sprintf(buf, "key_%d", i);
+		symtab_remove(tab, buf);
+	}
+
+	/* Changes between the steps split, merge and remove moved nodes */
+	while(symtab_compact(tab, 50))
+	{
+		sprintf(buf, "key_%d", steps * 2);
+		symtab_remove(tab, buf);
+		sprintf(buf, "key_%d", steps * 2 + 1);
+		symtab_put(tab, buf, steps * 2 + 2);
+		sprintf(buf, "key_%dx", steps);
+		symtab_put(tab, buf, 1);
+		++steps;
+	}
+
+	assert(steps > 10);
+	for(i = 0; i < 2000; ++i)
+	{
+		sprintf(buf, "key_%d", i);
+		assert(symtab_get(tab, buf) ==
+			(i < 2 * steps ? (i & 1) * (i + 1) : !(i & 1) * (i + 1)));
+	}
+
+	/* Without changes, every node ends up in the arena */
+	while(symtab_compact(tab, 100)) {}
+	symtab_stats(tab, &stats);
+	assert(stats.Leaves == 1000 + (size_t)steps);
+	assert(stats.AllocatorBytes < 8 * stats.Nodes);
+
+	/* Nodes shared with a snapshot stay where they are */
+	snap = symtab_snapshot(tab);
+	assert(symtab_compact(tab, 1) == 0);
+	assert(symtab_compact(snap, 1) == 0);
+	symtab_put(tab, "key_1", 0x1234);
+	while(symtab_compact(tab, 10)) {}
+	assert(symtab_get(tab, "key_1") == 0x1234);
+	assert(symtab_get(snap, "key_1") == 2);
+	symtab_destroy(snap);
+
+	/* A table can be destroyed in the middle of a pass */
+	assert(symtab_compact(tab, 10) == 1);
+	symtab_destroy(tab);
+}
+
+static void test_huge_pages(void)
+{
+	int i;
+	char buf[32];
+	SymTab *tab, *frozen;
+	SymStats stats;
+
+	printf("\ntest_huge_pages\n");
+
+	tab = symtab_create(CAPACITY);
+	for(i = 0; i < 2000; ++i)
+	{
+		sprintf(buf, "key_%d", i);
+		symtab_put(tab, buf, i + 1);
+	}
+
+	/* Switched on in the middle of a pass, the rest goes to huge pages */
+	assert(symtab_compact(tab, 500) == 1);
+	symtab_huge_pages(tab);
+	while(symtab_compact(tab, 500)) {}
+	symtab_stats(tab, &stats);
+	assert(stats.AllocatorBytes < 8 * stats.Nodes);
+
+	/* Nodes in huge chunks are split, merged and removed as usual */
+	for(i = 0; i < 2000; i += 3)
+	{
+		sprintf(buf, "key_%d", i);
+		symtab_remove(tab, buf);
+		sprintf(buf, "key_%dx", i);
+		symtab_put(tab, buf, i + 1);
+	}
+
+	while(symtab_compact(tab, 500)) {}
+	for(i = 0; i < 2000; ++i)
+	{
+		sprintf(buf, "key_%d", i);
+		assert(symtab_get(tab, buf) == (i % 3 ? i + 1 : 0));
+		sprintf(buf, "key_%dx", i);
+		assert(symtab_get(tab, buf) == (i % 3 ? 0 : i + 1));
+	}
+
+	frozen = symtab_freeze(tab);
+	symtab_destroy(tab);
+	for(i = 0; i < 2000; ++i)
+	{
+		sprintf(buf, "key_%d", i);
+		assert(symtab_get(frozen, buf) == (i % 3 ? i + 1 : 0));
+	}
+
+	symtab_destroy(frozen);
+}
+
+#define COMPRESS_KEYS 2000
+
+static void compress_callback(void *data, char *ident)
+{
+	int *n = data;
+	assert(!strncmp(ident, "https://example.com/users/1", 27));
+	++(*n);
+}
+
+static void test_compress(void)
+{
+	int i, cnt = 0;
+	char buf[128];
+	char **idents = malloc(COMPRESS_KEYS * sizeof(*idents));
+	SymTab *tab, *plain, *snap, *frozen;
+	SymStats stats, plain_stats;
+
+	printf("\ntest_compress\n");
+
+	for(i = 0; i < COMPRESS_KEYS; ++i)
+	{
+		sprintf(buf, "https://example.com/%s/%d/profile",
+			i % 3 ? "users" : "groups", i);
+		idents[i] = strdup(buf);
+	}
+
+	tab = symtab_create(CAPACITY);
+	plain = symtab_create(CAPACITY);
+	assert(symtab_compress(tab, (const char *const *)idents,
+		COMPRESS_KEYS) == 0);
+
+	for(i = 0; i < COMPRESS_KEYS; ++i)
+	{
+		symtab_put(tab, idents[i], i + 1);
+		symtab_put(plain, idents[i], i + 1);
+	}
+
+	assert(symtab_compress(tab, NULL, 0) == -1);
+
+	/* Bytes above 0x7F are escaped, splits can separate the escapes */
+	symtab_put(tab, "caf\xc3\xa9", 7001);
+	symtab_put(tab, "caf\xc3\xa8", 7002);
+	symtab_put(tab, "caf", 7003);
+
+	for(i = 0; i < COMPRESS_KEYS; ++i)
+	{
+		assert(symtab_get(tab, idents[i]) == i + 1);
+	}
+
+	assert(symtab_get(tab, "caf\xc3\xa9") == 7001);
+	assert(symtab_get(tab, "caf\xc3\xa8") == 7002);
+	assert(symtab_get(tab, "caf\xc3") == 0);
+	assert(symtab_get(tab, "https://example.com/users/1") == 0);
+
+	symtab_stats(tab, &stats);
+	symtab_stats(plain, &plain_stats);
+	printf("label bytes: %zu compressed, %zu plain\n",
+		stats.LabelBytes, plain_stats.LabelBytes);
+	assert(stats.LabelBytes < plain_stats.LabelBytes / 2);
+
+	/* users/1, users/10 to users/19, users/100 to users/199, users/1000
+		to users/1999, without the ones divisible by 3 */
+	strcpy(buf, "https://example.com/users/1");
+	assert(symtab_prefix_iter(tab, buf, 0, &cnt, compress_callback) ==
+		1 + 7 + 67 + 667);
+	assert(!strcmp(buf, "https://example.com/users/1"));
+
+	strcpy(buf, "https://example.com/gr");
+	assert(symtab_complete(tab, buf) == 1);
+	assert(!strcmp(buf, "https://example.com/groups/"));
+
+	strcpy(buf, "ca");
+	assert(symtab_complete(tab, buf) == 1);
+	assert(!strcmp(buf, "caf"));
+
+	strcpy(buf, "caf\xc3");
+	assert(symtab_complete(tab, buf) == 0);
+
+	strcpy(buf, "nothing");
+	assert(symtab_complete(tab, buf) == 0);
+
+	snap = symtab_snapshot(tab);
+	frozen = symtab_freeze(tab);
+	assert(symtab_remove(tab, "caf\xc3\xa9") == 7001);
+	assert(symtab_get(tab, "caf\xc3\xa9") == 0);
+	assert(symtab_get(snap, "caf\xc3\xa9") == 7001);
+	assert(symtab_get(frozen, "caf\xc3\xa9") == 7001);
+	assert(symtab_get(frozen, idents[5]) == 6);
+	symtab_destroy(frozen);
+	symtab_destroy(snap);
+	symtab_destroy(tab);
+	symtab_destroy(plain);
+
+	/* Evicted keys are decoded before they are removed */
+	tab = symtab_create_cache(100, 0);
+	symtab_compress(tab, (const char *const *)idents, COMPRESS_KEYS);
+	for(i = 0; i < COMPRESS_KEYS; ++i)
+	{
+		symtab_put(tab, idents[i], i + 1);
+	}
+
+	symtab_stats(tab, &stats);
+	assert(stats.Leaves == 100);
+	assert(symtab_get(tab, idents[COMPRESS_KEYS - 1]) == COMPRESS_KEYS);
+	symtab_destroy(tab);
+
+	for(i = 0; i < COMPRESS_KEYS; ++i)
+	{
+		free(idents[i]);
+	}
+
+	free(idents);
+}
+
+#define PARALLEL_KEYS   5000
+#define PARALLEL_THREADS 4
+
+static void parallel_callback(void *data, int worker, const char *ident,
+	int value)
+{
+	int *sums = data;
+	assert(worker >= 0 && worker < PARALLEL_THREADS);
+	assert(atoi(ident + 1) + 1 == value);
+	sums[worker] += value;
+}
+
+static void test_parallel(void)
+{
+	int i, sum, sums[PARALLEL_THREADS] = { 0 };
+	char buf[32];
+	char **idents = malloc(PARALLEL_KEYS * sizeof(*idents));
+	int *values = malloc(PARALLEL_KEYS * sizeof(*values));
+	SymTab *tab, *snap;
+	SymStats serial, parallel;
+
+	printf("\ntest_parallel\n");
+
+	for(i = 0; i < PARALLEL_KEYS; ++i)
+	{
+		sprintf(buf, "%c%d", 'a' + i % 26, i);
+		idents[i] = strdup(buf);
+		values[i] = i + 1;
+	}
+
+	tab = symtab_build((const char *const *)idents, values,
+		PARALLEL_KEYS, PARALLEL_THREADS);
+
+	for(i = 0; i < PARALLEL_KEYS; ++i)
+	{
+		assert(symtab_get(tab, idents[i]) == i + 1);
+	}
+
+	assert(symtab_get(tab, "a") == 0);
+
+	symtab_stats(tab, &serial);
+	symtab_stats_parallel(tab, &parallel, PARALLEL_THREADS);
+	assert(serial.Nodes == parallel.Nodes);
+	assert(serial.Leaves == PARALLEL_KEYS);
+	assert(parallel.Leaves == PARALLEL_KEYS);
+	assert(serial.LabelBytes == parallel.LabelBytes);
+	assert(serial.NodeBytes == parallel.NodeBytes);
+	assert(serial.AllocatorBytes == parallel.AllocatorBytes);
+	assert(!memcmp(serial.Depth, parallel.Depth, sizeof(serial.Depth)));
+	assert(!memcmp(serial.Siblings, parallel.Siblings,
+		sizeof(serial.Siblings)));
+
+	/* Keys "b1", "b27", "b53", ... with values 2, 28, 54, ... */
+	assert(symtab_prefix_iter_parallel(tab, "b", PARALLEL_THREADS, sums,
+		parallel_callback) == PARALLEL_KEYS / 26 + 1);
+
+	for(i = 0, sum = 0; i < PARALLEL_THREADS; ++i)
+	{
+		sum += sums[i];
+	}
+
+	assert(sum == (PARALLEL_KEYS / 26 + 1) * (2 + 2 + PARALLEL_KEYS / 26 * 26)
+		/ 2);
+
+	assert(symtab_prefix_iter_parallel(tab, "", PARALLEL_THREADS, sums,
+		parallel_callback) == PARALLEL_KEYS);
+
+	assert(symtab_prefix_iter_parallel(tab, "c2", PARALLEL_THREADS, sums,
+		parallel_callback) > 0);
+
+	assert(symtab_prefix_iter_parallel(tab, "x-", PARALLEL_THREADS, sums,
+		parallel_callback) == 0);
+
+	/* Shared nodes are left to the snapshot */
+	snap = symtab_snapshot(tab);
+	symtab_destroy_parallel(tab, PARALLEL_THREADS);
+	assert(symtab_get(snap, idents[7]) == 8);
+	symtab_destroy(snap);
+
+	tab = symtab_build((const char *const *)idents, values,
+		PARALLEL_KEYS, 0);
+	symtab_destroy_parallel(tab, PARALLEL_THREADS);
+
+	for(i = 0; i < PARALLEL_KEYS; ++i)
+	{
+		free(idents[i]);
+	}
+
+	free(idents);
+	free(values);
+}
+
+#define REPLICA_KEYS 1000
+
+static void *replica_reader(void *arg)
+{
+	SymReplicas *r = arg;
+	char buf[32];
+	int i, round, found = 0;
+
+	/* Symbols are only added, with the value they keep */
+	for(round = 0; round < 50; ++round)
+	{
+		for(i = 0; i < REPLICA_KEYS; ++i)
+		{
+			int v;
+			sprintf(buf, "key_%d", i);
+			v = symtab_replicas_get(r, buf);
+			assert(v == 0 || v == i + 1);
+			found += v != 0;
+		}
+	}
+
+	return (void *)(long)found;
+}
+
+static int replica_stop;
+
+/* Gets until the main thread stops publishing */
+static void *replica_stress(void *arg)
+{
+	SymReplicas *r = arg;
+	while(!__atomic_load_n(&replica_stop, __ATOMIC_ACQUIRE))
+	{
+		assert(symtab_replicas_get(r, "counter") >= 1);
+		assert(symtab_replicas_get(r, "main") == 1);
+	}
+
+	return NULL;
+}
+
+static void test_replicas(void)
+{
+	SymTab *tab;
+	SymReplicas *r;
+	pthread_t reader, readers[4];
+	char buf[32];
+	int i;
+
+	printf("\ntest_replicas\n");
+
+	/* One replica per node, one on machines without NUMA */
+	tab = symtab_create(CAPACITY);
+	symtab_put(tab, "main", 1);
+	r = symtab_replicas_create(tab, 0);
+	printf("%d replicas\n", symtab_replicas_count(r));
+	assert(symtab_replicas_count(r) >= 1);
+	assert(symtab_replicas_get(r, "main") == 1);
+	symtab_replicas_destroy(r);
+
+	tab = symtab_create(CAPACITY);
+	r = symtab_replicas_create(tab, 3);
+	assert(symtab_replicas_count(r) == 3);
+	assert(symtab_replicas_get(r, "key_0") == 0);
+	pthread_create(&reader, NULL, replica_reader, r);
+	for(i = 0; i < REPLICA_KEYS; ++i)
+	{
+		sprintf(buf, "key_%d", i);
+		assert(symtab_replicas_put(r, buf, i + 1) == 0);
+		if(i % 100 == 99)
+		{
+			symtab_replicas_publish(r);
+		}
+	}
+
+	pthread_join(reader, NULL);
+
+	/* Updates are visible after publishing */
+	assert(symtab_replicas_remove(r, "key_5") == 6);
+	assert(symtab_replicas_remove(r, "key_5") == 0);
+	assert(symtab_replicas_get(r, "key_5") == 6);
+	symtab_replicas_publish(r);
+	symtab_replicas_publish(r);
+	assert(symtab_replicas_get(r, "key_5") == 0);
+	assert(symtab_replicas_get(r, "key_999") == 1000);
+	symtab_replicas_destroy(r);
+
+	/* Replicas are freed by publishes while readers use them */
+	tab = symtab_create(CAPACITY);
+	symtab_put(tab, "main", 1);
+	symtab_put(tab, "counter", 1);
+	r = symtab_replicas_create(tab, 2);
+	for(i = 0; i < 4; ++i)
+	{
+		pthread_create(&readers[i], NULL, replica_stress, r);
+	}
+
+	for(i = 2; i < 200; ++i)
+	{
+		symtab_replicas_put(r, "counter", i);
+		symtab_replicas_publish(r);
+	}
+
+	__atomic_store_n(&replica_stop, 1, __ATOMIC_RELEASE);
+	for(i = 0; i < 4; ++i)
+	{
+		pthread_join(readers[i], NULL);
+	}
+
+	symtab_replicas_destroy(r);
+}
+
+#define DEEP_KEYS 4000
+
+/* Runs on a thread with a small stack, like the latency-sensitive workers,
+	returns the number of steps needed to destroy the table */
+static void *deep_worker(void *arg)
+{
+	SymTab *tab = arg;
+	SymStats stats;
+	long steps = 0;
+
+	symtab_stats(tab, &stats);
+	assert(stats.Leaves == 2 * DEEP_KEYS);
+	assert(stats.Depth[SYMTAB_HISTOGRAM - 1] > 0);
+
+	while(symtab_destroy_step(tab, 100))
+	{
+		++steps;
+	}
+
+	return (void *)steps;
+}
+
+static void test_deep(void)
+{
+	int i;
+	char *key = malloc(DEEP_KEYS + 1);
+	pthread_t thread;
+	pthread_attr_t attr;
+	void *steps;
+	SymTab *tab, *snap;
+
+	printf("\ntest_deep\n");
+
+	tab = symtab_create(CAPACITY);
+
+	/* Every prefix of a long key is a symbol, so the tree is a chain */
+	for(i = 0; i < DEEP_KEYS; ++i)
+	{
+		key[i] = 'a' + i % 26;
+		key[i + 1] = '\0';
+		symtab_put(tab, key, i + 1);
+	}
+
+	/* Long sibling list */
+	for(i = 0; i < DEEP_KEYS; ++i)
+	{
+		sprintf(key, "%c%d", 'b' + i % 20, i);
+		symtab_put(tab, key, i + 1);
+	}
+
+	/* The snapshot keeps half of the nodes alive */
+	snap = symtab_snapshot(tab);
+	symtab_put(tab, "b0", 7);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 64 * 1024);
+	pthread_create(&thread, &attr, deep_worker, snap);
+	pthread_join(thread, &steps);
+	assert((long)steps == 0);
+	pthread_create(&thread, &attr, deep_worker, tab);
+	pthread_join(thread, &steps);
+	assert((long)steps >= 2 * DEEP_KEYS / 100);
+	pthread_attr_destroy(&attr);
+	free(key);
+}
+
+static void test_durable(void)
+{
+	SymTab *tab;
+	FILE *fp;
+	char path[64], name[80];
+	struct rlimit limit, full;
+
+	printf("\ntest_durable\n");
+
+	sprintf(path, "/tmp/symtab-test-%d", (int)getpid());
+
+	tab = symtab_create(CAPACITY);
+	assert(symtab_durable(tab, path, 2) == 0);
+	symtab_put(tab, "team", 22);
+	symtab_put(tab, "test", 55);
+	symtab_put(tab, "toast", 44);
+	symtab_remove(tab, "team");
+	symtab_destroy(tab);
+
+	/* Recover from the log */
+	tab = symtab_create(CAPACITY);
+	assert(symtab_durable(tab, path, 0) == 0);
+	assert(symtab_get(tab, "team") == 0);
+	assert(symtab_get(tab, "test") == 55);
+	assert(symtab_get(tab, "toast") == 44);
+	assert(symtab_checkpoint(tab) == 0);
+	symtab_put(tab, "test", 56);
+	assert(symtab_sync(tab) == 0);
+	symtab_destroy(tab);
+
+	/* Append a torn record as if we crashed while writing it */
+	sprintf(name, "%s.log", path);
+	fp = fopen(name, "ab");
+	fwrite("\x05\x01\x00", 1, 3, fp);
+	fclose(fp);
+
+	/* Recover from image and log */
+	tab = symtab_create(CAPACITY);
+	assert(symtab_durable(tab, path, 1) == 0);
+	symtab_print(tab);
+	assert(symtab_get(tab, "test") == 56);
+	assert(symtab_get(tab, "toast") == 44);
+	symtab_put(tab, "team", 23);
+	symtab_destroy(tab);
+
+	tab = symtab_create(CAPACITY);
+	assert(symtab_durable(tab, path, 1) == 0);
+	assert(symtab_get(tab, "team") == 23);
+	assert(symtab_get(tab, "test") == 56);
+	symtab_destroy(tab);
+
+	/* A damaged image is an error, not a silently smaller table. The
+		second record is damaged, the first must not stay in the table. */
+	unlink(name);
+	sprintf(name, "%s.img", path);
+	fp = fopen(name, "r+b");
+	fseek(fp, 15, SEEK_SET);
+	fputc('X', fp);
+	fclose(fp);
+	tab = symtab_create(CAPACITY);
+	assert(symtab_durable(tab, path, 1) == -1);
+	assert(symtab_get(tab, "test") == 0);
+	assert(symtab_get(tab, "toast") == 0);
+	symtab_destroy(tab);
+	unlink(name);
+
+	/* Once a write failed, later records must not follow the lost ones */
+	tab = symtab_create(CAPACITY);
+	assert(symtab_durable(tab, path, 0) == 0);
+	symtab_put(tab, "lost", 1);
+	signal(SIGXFSZ, SIG_IGN);
+	getrlimit(RLIMIT_FSIZE, &limit);
+	full = limit;
+	full.rlim_cur = 0;
+	setrlimit(RLIMIT_FSIZE, &full);
+	assert(symtab_sync(tab) == -1);
+	setrlimit(RLIMIT_FSIZE, &limit);
+	signal(SIGXFSZ, SIG_DFL);
+	symtab_put(tab, "later", 2);
+	assert(symtab_sync(tab) == -1);
+	symtab_destroy(tab);
+
+	tab = symtab_create(CAPACITY);
+	assert(symtab_durable(tab, path, 0) == 0);
+	assert(symtab_get(tab, "lost") == 0);
+	assert(symtab_get(tab, "later") == 0);
+	symtab_destroy(tab);
+	sprintf(name, "%s.log", path);
+	unlink(name);
+}
+
+#endif
+
+static void test_trace(void)
+{
+	char line[64], text[64], binary[64];
+	TraceOp op;
+	FILE *fp;
+	int i;
+
+	printf("\ntest_trace\n");
+
+	strcpy(line, "  put\tkey_1 0x10\r\n");
+	assert(trace_parse(line, &op) == TRACE_OK);
+	assert(op.Op == TRACE_PUT && op.Value == 16 && !strcmp(op.Ident, "key_1"));
+	strcpy(line, "remove key_1");
+	assert(trace_parse(line, &op) == TRACE_OK);
+	assert(op.Op == TRACE_REMOVE && !strcmp(op.Ident, "key_1"));
+	strcpy(line, " # get key_1");
+	assert(trace_parse(line, &op) == TRACE_BLANK);
+	strcpy(line, "\n");
+	assert(trace_parse(line, &op) == TRACE_BLANK);
+	strcpy(line, "print");
+	assert(trace_parse(line, &op) == TRACE_UNKNOWN);
+	assert(!strcmp(op.Ident, "print"));
+	strcpy(line, "get ");
+	assert(trace_parse(line, &op) == TRACE_NO_IDENT);
+	strcpy(line, "put key 0");
+	assert(trace_parse(line, &op) == TRACE_NO_VALUE);
+	strcpy(line, "put key 12x");
+	assert(trace_parse(line, &op) == TRACE_NO_VALUE);
+
+	sprintf(text, "/tmp/symtab-trace-%d.txt", (int)getpid());
+	sprintf(binary, "/tmp/symtab-trace-%d.bin", (int)getpid());
+	fp = fopen(text, "w");
+	fprintf(fp, "# test trace\n\n");
+	for(i = 0; i < 300; ++i)
+	{
+		sprintf(line, "key_%d", i % 100);
+		op.Ident = line;
+		op.Op = i % 3;
+		op.Value = i + 1;
+		trace_write(fp, &op, 0);
+	}
+
+	fclose(fp);
+	assert(trace_replay(text) == 0);
+	assert(trace_convert(text, binary) == 0);
+	assert(trace_replay(binary) == 0);
+
+	/* A truncated binary trace is rejected */
+	assert(truncate(binary, 20) == 0);
+	assert(trace_replay(binary) == -1);
+
+	/* Also right after the operation byte of the last record */
+	fp = fopen(binary, "wb");
+	fputs(TRACE_MAGIC, fp);
+	fwrite("\0\001a", 1, 3, fp);
+	fputc(TRACE_PUT, fp);
+	fclose(fp);
+	assert(trace_replay(binary) == -1);
+
+	fp = fopen(text, "w");
+	fprintf(fp, "get a\nfrobnicate\n");
+	fclose(fp);
+	assert(trace_replay(text) == -1);
+	unlink(text);
+	assert(trace_replay(text) == -1);
+	unlink(binary);
+}
+
+/* Command line, the operations are written to `record` if it is set */
+static void test_cmdline(FILE *record)
 {
 	SymTab *tab = symtab_create(CAPACITY);
 	char buf[256];
-	char *delim = " \n";
-	char *p;
-	int running = 1;
+	TraceOp op;
+	int v, rv;
 
-	while(running)
+	for(;;)
 	{
 		printf("> ");
-		fgets(buf, sizeof(buf), stdin);
-
-		p = strtok(buf, delim);
-		if(p == NULL)
+		if(!fgets(buf, sizeof(buf), stdin))
 		{
-			continue;
+			break;
 		}
 
-		if(!strcmp(p, "quit"))
+		rv = trace_parse(buf, &op);
+		if(rv == TRACE_BLANK)
 		{
-			running = 0;
+			continue;
 		}
-		else if(!strcmp(p, "help"))
+		else if(rv == TRACE_NO_IDENT)
 		{
-			printf(
-				"Command\n"
-				"quit             | Quit\n"
-				"print            | Print all entries\n"
-				"get `ident`      | Get value for identifier\n"
-				"put `ident` int  | Insert identifier with value\n"
-				"remove `ident`   | Remove identifier\n");
+			printf("Invalid identifier\n");
+			continue;
 		}
-		else if(!strcmp(p, "print"))
+		else if(rv == TRACE_NO_VALUE)
 		{
-			symtab_print(tab);
+			printf("Invalid value\n");
+			continue;
 		}
-		else if(!strcmp(p, "get"))
+		else if(rv == TRACE_UNKNOWN)
 		{
-			p = strtok(NULL, delim);
-			if(p == NULL) { printf("Invalid identifier\n"); continue; }
-			int v = symtab_get(tab, p);
-			if(v == 0)
+			if(!strcmp(op.Ident, "quit"))
 			{
-				printf("Not found\n");
+				break;
+			}
+			else if(!strcmp(op.Ident, "help"))
+			{
+				printf(
+					"Command\n"
+					"quit             | Quit\n"
+					"print            | Print all entries\n"
+					"get `ident`      | Get value for identifier\n"
+					"put `ident` int  | Insert identifier with value\n"
+					"remove `ident`   | Remove identifier\n");
+			}
+			else if(!strcmp(op.Ident, "print"))
+			{
+				symtab_print(tab);
 			}
 			else
 			{
-				printf("%s = %d\n", p, v);
+				printf("Unknown command\n");
 			}
+
+			continue;
 		}
-		else if(!strcmp(p, "remove"))
+
+		if(record)
 		{
-			p = strtok(NULL, delim);
-			if(p == NULL) { printf("Invalid identifier\n"); continue; }
-			symtab_remove(tab, p);
+			trace_write(record, &op, 0);
 		}
-		else if(!strcmp(p, "put"))
+
+		if(op.Op == TRACE_GET)
 		{
-			p = strtok(NULL, delim);
-			if(p == NULL) { printf("Invalid identifier\n"); continue; }
-			char *q = strtok(NULL, delim);
-			if(q == NULL) { printf("Invalid value\n"); continue; }
-			int val = atoi(q);
-			if(val == 0)
+			v = symtab_get(tab, op.Ident);
+			if(v == 0)
 			{
-				printf("Invalid value\n");
+				printf("Not found\n");
 			}
 			else
 			{
-				symtab_put(tab, p, val);
-				printf("%s = %d\n", p, val);
+				printf("%s = %d\n", op.Ident, v);
 			}
 		}
+		else if(op.Op == TRACE_REMOVE)
+		{
+			symtab_remove(tab, op.Ident);
+		}
 		else
 		{
-			printf("Unknown command\n");
+			symtab_put(tab, op.Ident, op.Value);
+			printf("%s = %d\n", op.Ident, op.Value);
 		}
 	}
 
 	symtab_destroy(tab);
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
+	FILE *record;
+
+	if(argc > 1 && !strcmp(argv[1], "bench"))
+	{
+		bench_run(argc > 2 ? argv[2] : NULL);
+		return 0;
+	}
+
+	if(argc > 2 && !strcmp(argv[1], "replay"))
+	{
+		return trace_replay(argv[2]) ? 1 : 0;
+	}
+
+	if(argc > 3 && !strcmp(argv[1], "convert"))
+	{
+		return trace_convert(argv[2], argv[3]) ? 1 : 0;
+	}
+
+	if(argc > 2 && !strcmp(argv[1], "record"))
+	{
+		if(!(record = fopen(argv[2], "a")))
+		{
+			perror(argv[2]);
+			return 1;
+		}
+
+		test_cmdline(record);
+		fclose(record);
+		return 0;
+	}
+
 	printf("Starting SymTab Test\n");
 	test_put_get();
 	test_complete();
+	test_longest_prefix();
+	test_scan();
 	test_remove();
 	test_remove_prefix();
 	test_remove_suffix();
-	//test_prefix_iter();
+	test_prefix_iter();
 	test_remove_branch();
 	test_remove_prev_branch();
-	test_cmdline();
+#if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
+	test_snapshot();
+	test_durable();
+	test_fuzzy();
+	test_match();
+	test_cache();
+	test_hot_cache();
+	test_stats();
+	test_bloom();
+	test_freeze();
+	test_parallel();
+	test_compress();
+	test_compact();
+	test_huge_pages();
+	test_fold();
+	test_replicas();
+	test_deep();
+#endif
+	test_trace();
+	test_cmdline(NULL);
 
 	return 0;
 }
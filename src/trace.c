@@ -0,0 +1,567 @@
+/**
+ * @file    trace.c
+ * @author  Anton Tchekov
+ * @version 0.1
+ * @date    2023-09-02
+ * @brief   Recording and replaying traces of symbol table operations
+ *
+ * A trace is memory-mapped and decoded into an array of operations, with
+ * all identifiers NUL terminated in one buffer, before it is replayed.
+ */
+
+#include "trace.h"
+#include "symtab.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TRACE_SPACE   " \t\r\n"
+#define TRACE_BUCKETS 40
+#define TRACE_BAR     40
+
+/* Decoded trace */
+typedef struct
+{
+	TraceOp *Ops;
+	size_t Count;
+	size_t Capacity;
+	char *Keys;
+} Trace;
+
+/* Latencies of one operation, `Buckets[i]` counts those below 2^(i + 1) ns */
+typedef struct
+{
+	unsigned long Buckets[TRACE_BUCKETS];
+	unsigned long Count;
+	uint64_t Total;
+} TraceLatency;
+
+static const char *_names[TRACE_OPS] = { "get", "put", "remove" };
+
+/* --- PRIVATE --- */
+static uint64_t _nanos(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Returns the next word of `*p` and terminates it, or NULL at the end */
+static char *_word(char **p)
+{
+	char *start = *p + strspn(*p, TRACE_SPACE);
+	char *end;
+	if(!*start)
+	{
+		return NULL;
+	}
+
+	end = start + strcspn(start, TRACE_SPACE);
+	*p = *end ? end + 1 : end;
+	*end = '\0';
+	return start;
+}
+
+static const unsigned char *_map(const char *path, size_t *size)
+{
+	struct stat st;
+	void *data;
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		return NULL;
+	}
+
+	if(fstat(fd, &st))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	if(!st.st_size)
+	{
+		errno = ENODATA;
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	/* Decoding reads the trace once from start to end */
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	*size = st.st_size;
+	return data;
+}
+
+static void _trace_add(Trace *t, const TraceOp *op)
+{
+	if(t->Count == t->Capacity)
+	{
+		t->Capacity = t->Capacity ? 2 * t->Capacity : 1024;
+		t->Ops = realloc(t->Ops, t->Capacity * sizeof(*t->Ops));
+	}
+
+	t->Ops[t->Count++] = *op;
+}
+
+static int _decode_text(Trace *t, const unsigned char *data, size_t size,
+	const char *path)
+{
+	char *p, *end, *nl;
+	size_t lineno = 0;
+	TraceOp op;
+
+	t->Keys = malloc(size + 1);
+	memcpy(t->Keys, data, size);
+	t->Keys[size] = '\0';
+	end = t->Keys + size;
+	for(p = t->Keys; p < end; p = nl + 1)
+	{
+		int rv;
+		++lineno;
+		if(!(nl = memchr(p, '\n', end - p)))
+		{
+			nl = end;
+		}
+
+		*nl = '\0';
+		rv = trace_parse(p, &op);
+		if(rv == TRACE_OK)
+		{
+			_trace_add(t, &op);
+		}
+		else if(rv != TRACE_BLANK)
+		{
+			fprintf(stderr, "%s:%zu: invalid operation\n", path, lineno);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int _decode_binary(Trace *t, const unsigned char *data, size_t size,
+	const char *path)
+{
+	const unsigned char *p = data + strlen(TRACE_MAGIC);
+	const unsigned char *end = data + size, *start = p;
+	char *key;
+	TraceOp op;
+
+	/* Every record is longer than its NUL terminated identifier */
+	key = t->Keys = malloc(size);
+	while(p < end)
+	{
+		size_t len = 0;
+		int shift = 0;
+		start = p;
+		op.Op = *p++;
+		while(p < end && (*p & 0x80) && shift < 35)
+		{
+			len |= (size_t)(*p++ & 0x7F) << shift;
+			shift += 7;
+		}
+
+		if(op.Op >= TRACE_OPS || p >= end || shift >= 35)
+		{
+			break;
+		}
+
+		len |= (size_t)*p++ << shift;
+		if((size_t)(end - p) < len + (op.Op == TRACE_PUT ? 4 : 0))
+		{
+			break;
+		}
+
+		memcpy(key, p, len);
+		key[len] = '\0';
+		op.Ident = key;
+		key += len + 1;
+		p += len;
+		op.Value = 0;
+		if(op.Op == TRACE_PUT)
+		{
+			op.Value = p[0] | (p[1] << 8) | (p[2] << 16) |
+				((uint32_t)p[3] << 24);
+			p += 4;
+		}
+
+		_trace_add(t, &op);
+		start = p;
+	}
+
+	/* Also a record that was cut off after its first bytes */
+	if(start < end)
+	{
+		fprintf(stderr, "%s: invalid record at offset %zu\n",
+			path, (size_t)(start - data));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int _decode(Trace *t, const char *path)
+{
+	const unsigned char *data;
+	size_t size = 0, magic = strlen(TRACE_MAGIC);
+	int rv = 0;
+
+	t->Ops = NULL;
+	t->Count = 0;
+	t->Capacity = 0;
+	t->Keys = NULL;
+	if(!(data = _map(path, &size)))
+	{
+		perror(path);
+		return -1;
+	}
+
+	if(size >= magic && !memcmp(data, TRACE_MAGIC, magic))
+	{
+		rv = _decode_binary(t, data, size, path);
+	}
+	else
+	{
+		rv = _decode_text(t, data, size, path);
+	}
+
+	munmap((void *)data, size);
+	return rv;
+}
+
+static void _trace_free(Trace *t)
+{
+	free(t->Ops);
+	free(t->Keys);
+}
+
+static int _bucket(uint64_t ns)
+{
+	int i = 0;
+	while(ns > 1 && i < TRACE_BUCKETS - 1)
+	{
+		ns >>= 1;
+		++i;
+	}
+
+	return i;
+}
+
+/* Runs all operations, with the latency of each one if `lat` is set.
+	Returns a checksum of the results, to compare runs of the same trace. */
+static uint32_t _run(const Trace *t, SymTab *tab, TraceLatency *lat)
+{
+	uint32_t checksum = 2166136261u;
+	uint64_t start = 0, ns;
+	size_t i;
+	int result;
+
+	for(i = 0; i < t->Count; ++i)
+	{
+		const TraceOp *op = &t->Ops[i];
+		if(lat)
+		{
+			start = _nanos();
+		}
+
+		if(op->Op == TRACE_GET)
+		{
+			result = symtab_get(tab, op->Ident);
+		}
+		else if(op->Op == TRACE_PUT)
+		{
+			result = symtab_put(tab, op->Ident, op->Value);
+		}
+		else
+		{
+			result = symtab_remove(tab, op->Ident);
+		}
+
+		if(lat)
+		{
+			ns = _nanos() - start;
+			++lat[op->Op].Buckets[_bucket(ns)];
+			++lat[op->Op].Count;
+			lat[op->Op].Total += ns;
+		}
+
+		checksum = (checksum ^ (uint32_t)result) * 16777619u;
+	}
+
+	return checksum;
+}
+
+/* Upper bound of the latency below which a fraction `q` of the operations
+	completed */
+static uint64_t _percentile(const TraceLatency *lat, double q)
+{
+	unsigned long sum = 0;
+	int i;
+	for(i = 0; i < TRACE_BUCKETS - 1; ++i)
+	{
+		sum += lat->Buckets[i];
+		if(sum >= q * lat->Count)
+		{
+			break;
+		}
+	}
+
+	return (uint64_t)2 << i;
+}
+
+static void _print_latency(const TraceLatency *lat)
+{
+	TraceLatency all;
+	unsigned long max = 0;
+	int i, j;
+
+	memset(&all, 0, sizeof(all));
+	printf("\n%-8s %12s %8s %8s %8s %8s   (ns)\n",
+		"op", "count", "mean", "p50", "p99", "p99.9");
+
+	for(i = 0; i < TRACE_OPS; ++i)
+	{
+		if(!lat[i].Count)
+		{
+			continue;
+		}
+
+		printf("%-8s %12lu %8.0f %8llu %8llu %8llu\n", _names[i],
+			lat[i].Count, (double)lat[i].Total / lat[i].Count,
+			(unsigned long long)_percentile(&lat[i], 0.5),
+			(unsigned long long)_percentile(&lat[i], 0.99),
+			(unsigned long long)_percentile(&lat[i], 0.999));
+
+		all.Count += lat[i].Count;
+		for(j = 0; j < TRACE_BUCKETS; ++j)
+		{
+			all.Buckets[j] += lat[i].Buckets[j];
+		}
+	}
+
+	for(j = 0; j < TRACE_BUCKETS; ++j)
+	{
+		max = all.Buckets[j] > max ? all.Buckets[j] : max;
+	}
+
+	printf("\n%-14s %12s %7s\n", "latency (ns)", "count", "share");
+	for(j = 0; j < TRACE_BUCKETS; ++j)
+	{
+		if(!all.Buckets[j])
+		{
+			continue;
+		}
+
+		printf("< %-12llu %12lu %6.2f%% ", (unsigned long long)2 << j,
+			all.Buckets[j], 100.0 * all.Buckets[j] / all.Count);
+
+		for(i = 0; i < (int)(TRACE_BAR * all.Buckets[j] / max); ++i)
+		{
+			putchar('#');
+		}
+
+		putchar('\n');
+	}
+}
+
+static void _print_memory(const SymTab *tab)
+{
+#if SYMTAB_IMPLEMENTATION == SYMTAB_IMPL_TREE
+	SymStats stats;
+	symtab_stats(tab, &stats);
+	printf("\n%-14s %zu symbols, %zu nodes, %zu bytes "
+		"(%zu nodes, %zu allocator)\n", "memory", stats.Leaves, stats.Nodes,
+		stats.NodeBytes + stats.AllocatorBytes, stats.NodeBytes,
+		stats.AllocatorBytes);
+#else
+	(void)tab;
+#endif
+}
+
+/* --- PUBLIC --- */
+int trace_parse(char *line, TraceOp *op)
+{
+	char *p = line, *cmd, *value, *end;
+	long v;
+
+	cmd = _word(&p);
+	if(!cmd || *cmd == '#')
+	{
+		return TRACE_BLANK;
+	}
+
+	op->Ident = cmd;
+	op->Value = 0;
+	if(!strcmp(cmd, "get"))
+	{
+		op->Op = TRACE_GET;
+	}
+	else if(!strcmp(cmd, "put"))
+	{
+		op->Op = TRACE_PUT;
+	}
+	else if(!strcmp(cmd, "remove"))
+	{
+		op->Op = TRACE_REMOVE;
+	}
+	else
+	{
+		return TRACE_UNKNOWN;
+	}
+
+	if(!(op->Ident = _word(&p)))
+	{
+		return TRACE_NO_IDENT;
+	}
+
+	if(op->Op != TRACE_PUT)
+	{
+		return TRACE_OK;
+	}
+
+	if(!(value = _word(&p)))
+	{
+		return TRACE_NO_VALUE;
+	}
+
+	v = strtol(value, &end, 0);
+	if(*end || !v || v != (int)v)
+	{
+		return TRACE_NO_VALUE;
+	}
+
+	op->Value = v;
+	return TRACE_OK;
+}
+
+void trace_write(FILE *out, const TraceOp *op, int binary)
+{
+	size_t len = strlen(op->Ident), n = len;
+	uint32_t v = op->Value;
+
+	if(!binary)
+	{
+		if(op->Op == TRACE_PUT)
+		{
+			fprintf(out, "put %s %d\n", op->Ident, op->Value);
+		}
+		else
+		{
+			fprintf(out, "%s %s\n", _names[op->Op], op->Ident);
+		}
+
+		return;
+	}
+
+	fputc(op->Op, out);
+	do
+	{
+		fputc((n & 0x7F) | (n > 0x7F ? 0x80 : 0), out);
+		n >>= 7;
+	}
+	while(n);
+
+	fwrite(op->Ident, 1, len, out);
+	if(op->Op == TRACE_PUT)
+	{
+		fputc(v, out);
+		fputc(v >> 8, out);
+		fputc(v >> 16, out);
+		fputc(v >> 24, out);
+	}
+}
+
+int trace_convert(const char *in, const char *out)
+{
+	Trace t;
+	FILE *fp;
+	size_t i;
+	int rv = -1;
+
+	if(_decode(&t, in))
+	{
+		_trace_free(&t);
+		return -1;
+	}
+
+	if((fp = fopen(out, "wb")))
+	{
+		fputs(TRACE_MAGIC, fp);
+		for(i = 0; i < t.Count; ++i)
+		{
+			trace_write(fp, &t.Ops[i], 1);
+		}
+
+		rv = fclose(fp) ? -1 : 0;
+	}
+
+	if(rv)
+	{
+		perror(out);
+	}
+
+	_trace_free(&t);
+	return rv;
+}
+
+int trace_replay(const char *path)
+{
+	Trace t;
+	TraceLatency lat[TRACE_OPS];
+	SymTab *tab;
+	uint32_t checksum, check;
+	uint64_t start;
+	double seconds;
+	size_t i, puts = 0;
+
+	if(_decode(&t, path))
+	{
+		_trace_free(&t);
+		return -1;
+	}
+
+	/* The array implementation needs room for every symbol */
+	for(i = 0; i < t.Count; ++i)
+	{
+		puts += t.Ops[i].Op == TRACE_PUT;
+	}
+
+	tab = symtab_create(puts + 1);
+	start = _nanos();
+	checksum = _run(&t, tab, NULL);
+	seconds = (_nanos() - start) * 1e-9;
+	symtab_destroy(tab);
+
+	memset(lat, 0, sizeof(lat));
+	tab = symtab_create(puts + 1);
+	check = _run(&t, tab, lat);
+
+	printf("%-14s %s, %zu operations\n", "trace", path, t.Count);
+	printf("%-14s %.0f ops/s (%.3f s)\n", "throughput",
+		seconds > 0 ? t.Count / seconds : 0.0, seconds);
+	printf("%-14s %08x\n", "checksum", checksum);
+	_print_latency(lat);
+	_print_memory(tab);
+
+	if(check != checksum)
+	{
+		fprintf(stderr, "%s: results differ between the runs\n", path);
+	}
+
+	symtab_destroy(tab);
+	_trace_free(&t);
+	return checksum == check ? 0 : -1;
+}
@@ -0,0 +1,95 @@
+/**
+ * @file    trace.h
+ * @author  Anton Tchekov
+ * @version 0.1
+ * @date    2023-09-02
+ * @brief   Recording and replaying traces of symbol table operations
+ *
+ * A text trace has one operation per line, in the syntax of the command
+ * line: `get IDENT`, `put IDENT VALUE` or `remove IDENT`. Empty lines and
+ * lines starting with '#' are skipped.
+ *
+ * A binary trace starts with `TRACE_MAGIC`, followed by records of:
+ *
+ *   - Operation (1 byte, TRACE_GET, TRACE_PUT or TRACE_REMOVE)
+ *   - Identifier length (varint, 7 bits per byte)
+ *   - Identifier bytes
+ *   - Value (32-bit little endian, only for TRACE_PUT)
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+
+#define TRACE_MAGIC "SYMTRC1\n"
+
+/* Operations */
+enum
+{
+	TRACE_GET,
+	TRACE_PUT,
+	TRACE_REMOVE,
+	TRACE_OPS
+};
+
+/* Results of trace_parse */
+enum
+{
+	TRACE_OK,
+	TRACE_BLANK,
+	TRACE_UNKNOWN,
+	TRACE_NO_IDENT,
+	TRACE_NO_VALUE
+};
+
+/* One operation of a trace */
+typedef struct
+{
+	int Op;
+	int Value;
+	const char *Ident;
+} TraceOp;
+
+/**
+ * @brief Parses a line of a text trace or of the command line
+ *
+ * @param line Line of text, the words in it are terminated in place
+ * @param op Operation, for TRACE_UNKNOWN `Ident` is the command word
+ * @return TRACE_OK, TRACE_BLANK for empty lines and comments,
+ *         TRACE_UNKNOWN for other commands, TRACE_NO_IDENT or
+ *         TRACE_NO_VALUE if an argument is missing or the value is 0
+ */
+int trace_parse(char *line, TraceOp *op);
+
+/**
+ * @brief Writes an operation to a trace
+ *
+ * @param out Trace file, a binary trace must start with `TRACE_MAGIC`
+ * @param op Operation
+ * @param binary 1 for a binary trace, 0 for a text trace
+ */
+void trace_write(FILE *out, const TraceOp *op, int binary);
+
+/**
+ * @brief Converts a text trace to a binary trace
+ *
+ * @param in Path of the text trace
+ * @param out Path of the binary trace to create
+ * @return 0 on success, -1 on error
+ */
+int trace_convert(const char *in, const char *out);
+
+/**
+ * @brief Replays a text or binary trace against a new table and prints the
+ *        throughput, the latency histogram of every operation and the
+ *        memory used by the table at the end. The trace is decoded first,
+ *        so only the table operations are timed. Throughput is measured in
+ *        a run without the per-operation timing, latencies in a second run.
+ *
+ * @param path Path of the trace
+ * @return 0 on success, -1 if the trace can't be read or is invalid
+ */
+int trace_replay(const char *path);
+
+#endif /* __TRACE_H__ */
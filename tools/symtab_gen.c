@@ -0,0 +1,306 @@
+/**
+ * @file    symtab_gen.c
+ * @author  Anton Tchekov
+ * @version 0.1
+ * @date    2023-09-02
+ * @brief   Generates C source for a static symbol table
+ *
+ * Usage: symtab-gen [-n] NAME [FILE] > NAME.c
+ *
+ * Reads one symbol per line, the identifier followed by whitespace and a
+ * non-zero value. Empty lines and lines starting with '#' are skipped.
+ * The output defines `SymTab *const NAME`, a frozen table (see
+ * `symtab_freeze`) whose nodes and perfect hash index are const data:
+ * there is nothing to allocate or build at startup. Declare it with
+ * `extern SymTab *const NAME;` and use the normal lookup functions.
+ * With -n, no perfect hash index is emitted and `symtab_get` walks the tree.
+ */
+
+#include "symtab_impl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define LINE_MAX_LEN 4096
+
+/* Node of the frozen table and its number in the output */
+typedef struct
+{
+	const SymNode *Node;
+	size_t Index;
+} GenNode;
+
+/* --- PRIVATE --- */
+static int _cmp_node(const void *a, const void *b)
+{
+	const GenNode *x = a, *y = b;
+	return x->Node < y->Node ? -1 : x->Node > y->Node;
+}
+
+static size_t _index(const GenNode *sorted, size_t count,
+	const SymNode *entry)
+{
+	GenNode key, *found;
+	key.Node = entry;
+	found = bsearch(&key, sorted, count, sizeof(*sorted), _cmp_node);
+	return found->Index;
+}
+
+static void _string(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for(; *s; ++s)
+	{
+		unsigned char c = *s;
+		if(c == '"' || c == '\\')
+		{
+			fprintf(out, "\\%c", c);
+		}
+		else if(c >= 0x20 && c < 0x7F && c != '?')
+		{
+			fputc(c, out);
+		}
+		else
+		{
+			/* Always three digits, so a following digit isn't part of it */
+			fprintf(out, "\\%03o", c);
+		}
+	}
+
+	fputc('"', out);
+}
+
+static void _ref(FILE *out, const char *name, const GenNode *sorted,
+	size_t count, const SymNode *entry)
+{
+	if(entry)
+	{
+		fprintf(out, "(SymNode *)&%s_node_%zu", name,
+			_index(sorted, count, entry));
+	}
+	else
+	{
+		fprintf(out, "NULL");
+	}
+}
+
+static SymTab *_read(FILE *in, const char *file)
+{
+	SymTab *tab = symtab_create(0);
+	char line[LINE_MAX_LEN];
+	int lineno = 0;
+	while(fgets(line, sizeof(line), in))
+	{
+		char *p = line, *ident, *end;
+		long value;
+		++lineno;
+		while(isspace((unsigned char)*p))
+		{
+			++p;
+		}
+
+		if(!*p || *p == '#')
+		{
+			continue;
+		}
+
+		ident = p;
+		while(*p && !isspace((unsigned char)*p))
+		{
+			++p;
+		}
+
+		if(*p)
+		{
+			*p++ = '\0';
+		}
+
+		value = strtol(p, &end, 0);
+		while(isspace((unsigned char)*end))
+		{
+			++end;
+		}
+
+		if(end == p || *end || !value || value != (int)value)
+		{
+			fprintf(stderr, "%s:%d: expected identifier and non-zero value\n",
+				file, lineno);
+			symtab_destroy(tab);
+			return NULL;
+		}
+
+		if(symtab_put(tab, ident, value))
+		{
+			fprintf(stderr, "%s:%d: duplicate symbol \"%s\"\n",
+				file, lineno, ident);
+		}
+	}
+
+	return tab;
+}
+
+static void _emit(FILE *out, const char *name, const SymTab *tab)
+{
+	GenNode *nodes, *sorted;
+	const SymNode **stack;
+	size_t count = 0, top = 0, bytes = 0, i;
+	uint32_t j;
+
+	/* Number the nodes in pre-order, the order of the frozen table */
+	nodes = malloc((2 * tab->Count + 1) * sizeof(*nodes));
+	stack = malloc((2 * tab->Count + 1) * sizeof(*stack));
+	stack[top++] = tab->Root;
+	while(top)
+	{
+		const SymNode *entry = stack[--top];
+		nodes[count].Node = entry;
+		nodes[count].Index = count;
+		++count;
+		bytes += offsetof(SymNode, Label) + strlen(entry->Label) + 1;
+		if(entry->Next)
+		{
+			stack[top++] = entry->Next;
+		}
+
+		if(entry->Children)
+		{
+			stack[top++] = entry->Children;
+		}
+	}
+
+	sorted = malloc(count * sizeof(*sorted));
+	memcpy(sorted, nodes, count * sizeof(*sorted));
+	qsort(sorted, count, sizeof(*sorted), _cmp_node);
+
+	fprintf(out, "/* Generated by symtab-gen, do not edit */\n\n");
+	fprintf(out, "#include \"symtab_impl.h\"\n\n");
+
+	/* Nodes only point to nodes that come later in pre-order,
+		so defining them in reverse needs no forward declarations */
+	for(i = count; i--; )
+	{
+		const SymNode *entry = nodes[i].Node;
+		fprintf(out, "static const SymNode %s_node_%zu = { ", name, i);
+		_ref(out, name, sorted, count, entry->Next);
+		fprintf(out, ", ");
+		_ref(out, name, sorted, count, entry->Children);
+		fprintf(out, ", %d, 1, 0, ", entry->Value);
+		_string(out, entry->Label);
+		fprintf(out, " };\n");
+	}
+
+	if(tab->Hash)
+	{
+		const SymHash *hash = tab->Hash;
+		fprintf(out, "\nstatic const SymHashSlot %s_slots[%u] =\n{\n",
+			name, hash->Size);
+		for(j = 0; j < hash->Size; ++j)
+		{
+			fprintf(out, "\t{ ");
+			_string(out, hash->Slots[j].Key);
+			fprintf(out, ", %d },\n", hash->Slots[j].Value);
+		}
+
+		fprintf(out, "};\n\nstatic const uint32_t %s_seeds[%u] =\n{",
+			name, hash->Buckets);
+		for(j = 0; j < hash->Buckets; ++j)
+		{
+			fprintf(out, "%s%u,", j % 8 ? " " : "\n\t", hash->Seeds[j]);
+		}
+
+		fprintf(out, "\n};\n\nstatic const SymHash %s_hash =\n{\n"
+			"\t%s_seeds,\n\t%s_slots,\n\t%u,\n\t%u\n};\n",
+			name, name, name, hash->Buckets, hash->Size);
+	}
+
+	fprintf(out, "\nstatic SymTab %s_table =\n{\n", name);
+	fprintf(out, "\t.Root = (SymNode *)&%s_node_0,\n", name);
+	fprintf(out, "\t.ReadOnly = 1,\n\t.Frozen = 1,\n");
+	fprintf(out, "\t.Count = %zu,\n\t.Bytes = %zu,\n", tab->Count, bytes);
+	if(tab->Hash)
+	{
+		fprintf(out, "\t.Hash = &%s_hash,\n", name);
+	}
+
+	fprintf(out, "};\n\nSymTab *const %s = &%s_table;\n", name, name);
+	free(sorted);
+	free(stack);
+	free(nodes);
+}
+
+static int _usage(void)
+{
+	fprintf(stderr, "Usage: symtab-gen [-n] NAME [FILE] > NAME.c\n");
+	return 1;
+}
+
+/* --- PUBLIC --- */
+int main(int argc, char **argv)
+{
+	int hash = 1, arg = 1;
+	const char *name, *file = "<stdin>", *p;
+	FILE *in = stdin;
+	SymTab *tab, *frozen;
+
+	if(arg < argc && !strcmp(argv[arg], "-n"))
+	{
+		hash = 0;
+		++arg;
+	}
+
+	if(arg >= argc || argc - arg > 2)
+	{
+		return _usage();
+	}
+
+	name = argv[arg++];
+	for(p = name; *p; ++p)
+	{
+		if(!(isalpha((unsigned char)*p) || *p == '_' ||
+			(p > name && isdigit((unsigned char)*p))))
+		{
+			fprintf(stderr, "symtab-gen: NAME must be a C identifier\n");
+			return 1;
+		}
+	}
+
+	if(arg < argc)
+	{
+		file = argv[arg];
+		if(!(in = fopen(file, "r")))
+		{
+			perror(file);
+			return 1;
+		}
+	}
+
+	tab = _read(in, file);
+	if(in != stdin)
+	{
+		fclose(in);
+	}
+
+	if(!tab)
+	{
+		return 1;
+	}
+
+	frozen = symtab_freeze(tab);
+	if(hash && !frozen->Hash && frozen->Count)
+	{
+		fprintf(stderr, "symtab-gen: no perfect hash found, "
+			"lookups will walk the tree\n");
+	}
+
+	if(!hash && frozen->Hash)
+	{
+		free((void *)frozen->Hash);
+		frozen->Hash = NULL;
+	}
+
+	_emit(stdout, name, frozen);
+	symtab_destroy(frozen);
+	symtab_destroy(tab);
+	return 0;
+}